@@ -46,6 +46,24 @@ static Color colors[] = {
 #define NMASTER		1
 /* scroll back buffer size in lines */
 #define SCROLL_HISTORY	1024
+/* rows whose content did not change are not repainted, this is detected by
+ * a hash of the row. Set to true to also compare against a copy of the row. */
+#define STRICT_ROW_COMPARE false
+/* output of busy clients is read in turns of READ_QUANTUM bytes each, for at
+ * most READ_BUDGET bytes and READ_BUDGET_TIME seconds before the screen is
+ * updated */
+#define READ_QUANTUM	(16 * 1024)
+#define READ_BUDGET	(1 << 20)
+#define READ_BUDGET_TIME	0.02
+/* number of threads reading the output of the clients, 0 to read it in the
+ * main loop. They keep the applications from blocking while the screen is
+ * updated. */
+#define PTY_READERS	0
+/* number of threads parsing the output of clients besides the main one */
+#define PARSE_THREADS	0
+/* output rate every client is limited to in bytes per second, 0 for none.
+ * It can be changed with the ratelimit command. */
+#define RATE_LIMIT	0
 /* printf format string for the tag in the status bar */
 #define TAG_SYMBOL	"[%s]"
 /* curses attributes for the currently selected tags */
@@ -206,6 +224,8 @@ static Button buttons[] = {
 
 static Cmd commands[] = {
 	{ "create", { create, { NULL } } },
+	{ "ratelimit", { ratelimit, { NULL } } },
+	{ "colorstats", { colorstats, { NULL } } },
 };
 
 /* gets executed when dvtm is started */
@@ -217,6 +237,11 @@ static char const * const keytable[] = {
 	/* add your custom key escape sequences */
 };
 
+/* read the input as is instead of through curses: key bindings are matched
+ * on the bytes, everything else goes to the application unchanged. There is
+ * no mouse support in this mode. */
+#define RAW_INPUT 0
+
 /* editor to use for copy mode. If neither of DVTM_EDITOR, EDITOR and PAGER is
  * set the first entry is chosen. Otherwise the array is consulted for supported
  * options. A %d in argv is replaced by the line number at which the file should
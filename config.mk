@@ -7,8 +7,12 @@ MANPREFIX = ${PREFIX}/share/man
 TERMINFO := ${DESTDIR}${PREFIX}/share/terminfo
 
 INCS = -I.
-LIBS = -lc -lutil -lncursesw
+LIBS = -lc -lutil -lncursesw -lpthread
 CPPFLAGS = -D_POSIX_C_SOURCE=200809L -D_XOPEN_SOURCE=700 -D_XOPEN_SOURCE_EXTENDED
+# read from the ptys through io_uring(7), Linux only
+#CPPFLAGS += -D_DEFAULT_SOURCE -DCONFIG_IO_URING=1
+# a larger pipe to the thread writing to the terminal, Linux only
+#CPPFLAGS += -D_GNU_SOURCE
 CFLAGS += -std=c99 ${INCS} -DNDEBUG ${CPPFLAGS}
 
 CC ?= cc
@@ -13,12 +13,15 @@
  * See LICENSE for details.
  */
 
+#include <ctype.h>
 #include <curses.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -33,11 +36,22 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #if defined(__CYGWIN__) || defined(__sun)
 # include <termios.h>
 #endif
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <sys/signalfd.h>
+#endif
+#if defined(__linux__) && CONFIG_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
 #if defined(__GLIBC__) && __GLIBC_PREREQ(2, 1)
 # include <execinfo.h>
 
@@ -69,7 +83,9 @@ typedef struct {
 	int history;
 	int w;
 	int h;
+	double resize_at;	/* when to handle a pending resize of the terminal */
 	bool need_resize:1;
+	bool need_arrange:1;
 } Screen;
 
 typedef struct {
@@ -93,10 +109,25 @@ struct Client {
 	unsigned short int y;
 	unsigned short int w;
 	unsigned short int h;
+	struct {
+		unsigned short int x, y, w, h;
+		bool visible;
+	} drawn;		/* geometry the content was last drawn with */
 	bool has_title_line:1;
+	bool need_resize:1;	/* pty size is outdated, deferred while content is not visible */
 	bool minimized:1;
 	bool urgent:1;
+	bool throttled:1;	/* output is not read until the allowance recovered */
+	bool writing:1;		/* pty is watched until the queued input is written */
+	bool editor_writing:1;
+	double rate;		/* bytes per second the output is limited to, 0 if unlimited */
+	double allowance;	/* bytes which may be read before the limit applies */
+	double allowance_at;	/* when the allowance was last refilled */
+	bool title_changed;	/* set by the terminal callbacks, which might */
+	bool bell;		/* run on a parser thread, see handle_term() */
 	volatile sig_atomic_t died;
+	bool noticed;		/* on the list of clients to look at, see notice() */
+	Client *nnext;
 	Client *next;
 	Client *prev;
 	Client *snext;
@@ -161,12 +192,168 @@ typedef struct {
 	unsigned short int id;
 } CmdFifo;
 
+/* terminals accepting less bytes per second are considered slow */
+#define OUTPUT_FAST_RATE (1 << 20)
+
+/* resizes of the terminal are handled once it kept its size for this long */
+#define RESIZE_DELAY 0.05
+
+/* a rate limited client may read this many seconds worth of output at once */
+#define RATE_BURST 0.1
+
+/* how long to wait for the selected client to echo a key before going on */
+#define ECHO_DELAY 0.002
+
+/* the writer thread buffers at most this many bytes, curses has to wait beyond */
+#define OUTPUT_QUEUE_MAX (16 << 20)
+
+typedef struct {
+	int fd;			/* the outer terminal, stdout is redirected to pipe */
+	int tty;		/* non-blocking descriptor of it used by the writer thread */
+	int pipe[2];		/* output of curses, drained by the writer thread */
+	int idle_pipe[2];	/* signaled by the writer thread once all is written */
+	bool urgent;		/* an echo is waiting, other clients are not drawn */
+	bool sync;		/* terminal supports synchronized updates (mode 2026) */
+	double next_frame;	/* earliest time the next frame should be written */
+	pthread_t thread;
+	pthread_mutex_t lock;	/* protects the statistics of the writer below */
+	double rate;		/* bytes per second the terminal accepts, 0 if unknown */
+	size_t total;		/* number of bytes taken from pipe */
+	size_t queued;		/* of those not yet written to the terminal */
+} Output;
+
+/* event sources besides the ptys, which are tagged with their Vt */
+enum { EV_STDIN, EV_SIGNAL, EV_OUTPUT, EV_CMDFIFO, EV_STATUSBAR, EV_RING, EV_READER, EV_WRITABLE, EV_LAST };
+
+typedef struct {
+#ifdef __linux__
+	int fd;			/* epoll(7) instance */
+	int out;		/* the same for ptys with queued input, part of the above */
+	struct {
+		int fd;
+		void *data;
+	} always[4];		/* files epoll(7) refuses, they never block */
+	unsigned int nalways;
+#else
+	struct {
+		int fd;
+		void *data;
+		bool out;	/* watched for writing instead of reading */
+	} *watched;		/* file descriptors to select(2) on */
+	unsigned int count, size;
+#endif
+	char sources[EV_LAST];	/* their addresses identify the event sources */
+} Events;
+
+#if defined(__linux__) && CONFIG_IO_URING
+/* a read which is kept posted on a pty */
+typedef struct RingRead RingRead;
+struct RingRead {
+	Vt *term;
+	bool posted;		/* submitted but not yet completed */
+	bool removing;		/* do not post again, the pty is being unwatched */
+	RingRead *next;
+	char buf[BUFSIZ];
+};
+
+typedef struct {
+	int fd;			/* io_uring(7) instance, -1 if not available */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	unsigned int queued;	/* prepared submission entries */
+	RingRead *reads;
+} Ring;
+#endif
+
+/* size of the buffer between a reader thread and the main loop, a power of 2 */
+#define PTY_BUFFER_SIZE (64 * 1024)
+
+typedef struct Reader Reader;
+
+/* output read by a reader thread, handed to the main loop through a single
+ * producer, single consumer ring buffer */
+typedef struct PtyBuffer PtyBuffer;
+struct PtyBuffer {
+	Vt *term;
+	int fd;
+	Reader *reader;
+	PtyBuffer *next;	/* in the list of the reader, changed under its lock */
+	size_t head;		/* advanced by the reader */
+	size_t tail;		/* advanced by the main loop */
+	bool hangup;		/* the reader found the pty gone */
+	bool full;		/* the pty is not polled until the main loop made room */
+	char buf[PTY_BUFFER_SIZE];
+};
+
+struct Reader {
+	pthread_t thread;
+	pthread_mutex_t lock;	/* protects buffers and changed */
+	PtyBuffer *buffers;
+	bool changed;		/* buffers were added or removed while polling */
+	int wake[2];		/* makes the thread poll the current buffers */
+};
+
+typedef struct {
+	Reader *threads;
+	unsigned int count, next;
+	int notify[2];		/* signals the main loop that output arrived */
+	bool notified;		/* notify was written but not yet cleared */
+} Readers;
+
+/* a terminal whose output is parsed or drawn in a round of jobs */
+typedef struct ParseJob ParseJob;
+struct ParseJob {
+	Vt *term;
+	size_t max;
+	ssize_t len;		/* result of pty_process() */
+	int err;		/* and its errno */
+};
+
+typedef struct {
+	pthread_t *threads;
+	unsigned int count;
+	pthread_mutex_t lock;	/* protects everything below */
+	pthread_cond_t start;	/* a round of jobs was handed out */
+	pthread_cond_t finish;	/* the last job of the round was done */
+	void (*run)(ParseJob *);
+	ParseJob *jobs;
+	unsigned int njobs, next, done;
+} Parsers;
+
 typedef struct {
 	char *data;
 	size_t len;
 	size_t size;
 } Register;
 
+/* the bytes a key binding consists of, with RAW_INPUT */
+typedef struct {
+	char seq[32];
+	unsigned int len;
+	unsigned int first;	/* length of the first key */
+} RawBinding;
+
+typedef struct {
+	bool start[256];	/* bytes with which a binding or a paste starts */
+	char held[32];		/* the start of a binding or a paste */
+	unsigned int len;
+	double since;		/* when the first of them arrived */
+	bool typed;		/* input was forwarded, its echo is awaited */
+	int curskeymode;	/* of the outer terminal, -1 if unknown */
+} RawInput;
+
+typedef struct {
+	bool csiu;		/* ambiguous keys arrive as CSI u, see csiu_decode() */
+	bool escape;		/* a lone escape waits for what might follow */
+	double escape_at;	/* when it arrived */
+	double delay;		/* how long it waits, ESCDELAY as set up by the user */
+	char typeahead[1024];	/* input which arrived during terminal_query() */
+	size_t typeahead_len;
+} Keyboard;
+
 typedef struct {
 	char *name;
 	const char *argv[4];
@@ -183,6 +370,7 @@ typedef struct {
 #endif
 
 /* commands for use by keybindings */
+static void colorstats(const char *args[]);
 static void create(const char *args[]);
 static void copymode(const char *args[]);
 static void focusn(const char *args[]);
@@ -199,6 +387,7 @@ static void focusright(const char *args[]);
 static void killclient(const char *args[]);
 static void paste(const char *args[]);
 static void quit(const char *args[]);
+static void ratelimit(const char *args[]);
 static void redraw(const char *args[]);
 static void scrollback(const char *args[]);
 static void send(const char *args[]);
@@ -239,6 +428,9 @@ static char *title;
 /* global functions */
 static void setup(void);
 static void cleanup(void);
+static void output_frame(void);
+static void raw_setup(void);
+static void parse_round(ParseJob jobs[], unsigned int n, void (*run)(ParseJob *));
 
 /* global variables */
 static const char *dvtm_name = "dvtm";
@@ -246,6 +438,7 @@ Screen screen = { .mfact = MFACT,
 		  .nmaster = NMASTER,
 		  .history = SCROLL_HISTORY };
 static Client *stack = NULL;
+static Client *noticed = NULL;
 static Client *sel = NULL;
 static Client *lastsel = NULL;
 static Client *msel = NULL;
@@ -259,12 +452,34 @@ static StatusBar bar = { .fd = -1,
 			 .autohide = BAR_AUTOHIDE,
 			 .h = 1 };
 static CmdFifo cmdfifo = { .fd = -1 };
+static Output output = { .fd = -1,
+			 .pipe = { -1, -1 },
+			 .idle_pipe = { -1, -1 },
+			 .lock = PTHREAD_MUTEX_INITIALIZER };
+static double wakeup; /* when the main loop has to run again, 0 if idle */
 static const char *shell = NULL;
 static Register copyreg;
+static Register pasted;		/* what is being pasted into the outer terminal */
+static bool pasting;
+static RawInput rawinput = { .curskeymode = -1 };
+static RawBinding rawbindings[countof(bindings)];
+static Keyboard keyboard;
 static volatile sig_atomic_t running = true;
 static bool runinall = false;
-static int sigwinch_pipe[] = { -1, -1 };
-static int sigchld_pipe[] = { -1, -1 };
+static int signal_fd = -1; /* signalfd(2) or read end of signal_pipe */
+#ifndef __linux__
+static int signal_pipe[] = { -1, -1 };
+#endif
+static Events events;
+#if defined(__linux__) && CONFIG_IO_URING
+static Ring ring = { .fd = -1 };
+#endif
+static Readers readers = { .notify = { -1, -1 } };
+static Parsers parsers = { .lock = PTHREAD_MUTEX_INITIALIZER,
+			   .start = PTHREAD_COND_INITIALIZER,
+			   .finish = PTHREAD_COND_INITIALIZER };
+static KeyCombo keys;
+static unsigned int key_index;
 
 enum { PIPE_READ = 0, PIPE_WRITE = 1 };
 
@@ -285,6 +500,19 @@ static void error(const char *errstr, ...)
 	exit(EXIT_FAILURE);
 }
 
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wakeup_at(double when)
+{
+	if (!wakeup || when < wakeup)
+		wakeup = when;
+}
+
 static bool isarrange(void (*func)(void))
 {
 	return func == layout->arrange;
@@ -444,38 +672,121 @@ static void draw_border(Client *c)
 	wmove(c->window, y, x);
 }
 
+static void render_job(ParseJob *job)
+{
+	Client *c = vt_data_get(job->term);
+	vt_render(c->term, c->has_title_line, 0);
+}
+
+/* finding out what changed in the clients happens in parallel, curses is
+ * not thread safe and thus only used by the main thread */
+static void draw_contents(Client *list[], unsigned int n)
+{
+	ParseJob jobs[MAX(n, 1)];
+
+	for (unsigned int i = 0; i < n; i++)
+		jobs[i].term = list[i]->term;
+	parse_round(jobs, n, render_job);
+	for (unsigned int i = 0; i < n; i++)
+		vt_draw(list[i]->term, list[i]->window, list[i]->has_title_line, 0);
+	/* come back once the application has to be drawn regardless */
+	for (unsigned int i = 0; i < n; i++) {
+		int ms = vt_sync_timeout(list[i]->term);
+		if (ms >= 0)
+			wakeup_at(timestamp() + ms / 1000.0);
+	}
+}
+
 static void draw_content(Client *c)
 {
-	vt_draw(c->term, c->window, c->has_title_line, 0);
+	draw_contents(&c, 1);
 }
 
-static void draw(Client *c)
+static bool output_fast(void);
+
+static void resize_pty(Client *c)
+{
+	if (!c->need_resize)
+		return;
+	c->need_resize = false;
+	vt_resize(c->app, c->h - c->has_title_line, c->w);
+	if (c->editor)
+		vt_resize(c->editor, c->h - c->has_title_line, c->w);
+}
+
+/* prepares the window of c for its content, if that is visible */
+static bool draw_begin(Client *c)
 {
 	if (is_content_visible(c)) {
-		redrawwin(c->window);
-		draw_content(c);
+		resize_pty(c);
+		/* a window which stayed in place only has to be copied again,
+		 * curses knows what is on the terminal. Otherwise repainting
+		 * everything is only affordable on fast terminals. */
+		bool moved = !c->drawn.visible || c->drawn.x != c->x || c->drawn.y != c->y ||
+			     c->drawn.w != c->w || c->drawn.h != c->h;
+		if (moved && output_fast())
+			redrawwin(c->window);
+		else
+			touchwin(c->window);
+		c->drawn.x = c->x;
+		c->drawn.y = c->y;
+		c->drawn.w = c->w;
+		c->drawn.h = c->h;
+		c->drawn.visible = true;
+		return true;
 	}
+	return false;
+}
+
+static void draw_end(Client *c)
+{
 	if (!isarrange(fullscreen) || sel == c)
 		draw_border(c);
 	wnoutrefresh(c->window);
 }
 
+static void draw(Client *c)
+{
+	if (draw_begin(c))
+		draw_content(c);
+	draw_end(c);
+}
+
 static void draw_all(void)
 {
+	unsigned int n = 0, m = 0;
+
+	for (Client *c = clients; c; c = c->next, n++) {
+		if (!is_content_visible(c))
+			c->drawn.visible = false;
+	}
+
 	if (!nextvisible(clients)) {
 		sel = NULL;
 		curs_set(0);
 		erase();
 		drawbar();
-		doupdate();
+		output_frame();
 		return;
 	}
 
+	Client *list[n];
+	if (!isarrange(fullscreen)) {
+		for (Client *c = nextvisible(clients); c;
+		     c = nextvisible(c->next)) {
+			if (c != sel && draw_begin(c))
+				list[m++] = c;
+		}
+	}
+	if (sel && draw_begin(sel))
+		list[m++] = sel;
+	draw_contents(list, m);
+
 	if (!isarrange(fullscreen)) {
 		for (Client *c = nextvisible(clients); c;
 		     c = nextvisible(c->next)) {
 			if (c != sel)
-				draw(c);
+				draw_end(c);
 		}
 	}
 	/* as a last step the selected window is redrawn,
@@ -483,13 +794,36 @@ static void draw_all(void)
 	 * accurate
 	 */
 	if (sel)
-		draw(sel);
+		draw_end(sel);
 }
 
-static void arrange(void)
+/* draws what changed in the visible windows, the selected one last */
+static void draw_changes(void)
+{
+	unsigned int n = 1, m = 0;
+
+	for (Client *c = clients; c; c = c->next)
+		n++;
+	Client *list[n];
+	for (Client *c = clients; c && !output.urgent; c = c->next) {
+		if (c != sel && is_content_visible(c))
+			list[m++] = c;
+	}
+	if (is_content_visible(sel))
+		list[m++] = sel;
+	draw_contents(list, m);
+
+	for (unsigned int i = 0; i < m; i++)
+		wnoutrefresh(list[i]->window);
+	if (is_content_visible(sel))
+		curs_set(vt_cursor_visible(sel->term));
+}
+
+static void arrange_apply(void)
 {
 	int m = 0;
 	unsigned int n = 0;
+	screen.need_arrange = false;
 	for (Client *c = nextvisible(clients); c; c = nextvisible(c->next)) {
 		c->order = ++n;
 		if (c->minimized)
@@ -525,6 +859,14 @@ static void arrange(void)
 	draw_all();
 }
 
+/* the layout is only computed once before the next frame is drawn,
+ * bursts of changes thus result in a single layout and repaint */
+static void arrange(void)
+{
+	screen.need_arrange = true;
+	focus(NULL);
+}
+
 static void attach(Client *c)
 {
 	if (clients)
@@ -596,6 +938,28 @@ static void detachstack(Client *c)
 	*tc = c->snext;
 }
 
+/* the main loop only looks at the clients which produced output, died or
+ * are throttled, instead of going through all of them */
+static void notice(Client *c)
+{
+	if (c->noticed)
+		return;
+	c->noticed = true;
+	c->nnext = noticed;
+	noticed = c;
+}
+
+static void unnotice(Client *c)
+{
+	Client **tc;
+	if (!c->noticed)
+		return;
+	for (tc = &noticed; *tc && *tc != c; tc = &(*tc)->nnext)
+		;
+	*tc = c->nnext;
+	c->noticed = false;
+}
+
 static void focus(Client *c)
 {
 	if (!c)
@@ -605,9 +969,13 @@ static void focus(Client *c)
 		return;
 	lastsel = sel;
 	sel = c;
+	/* a pending layout redraws everything once the geometry is known */
+	bool redraw = !screen.need_arrange;
 	if (lastsel) {
 		lastsel->urgent = false;
-		if (!isarrange(fullscreen)) {
+		if (isarrange(fullscreen)) {
+			lastsel->drawn.visible = false;
+		} else if (redraw) {
 			draw_border(lastsel);
 			wnoutrefresh(lastsel->window);
 		}
@@ -618,9 +986,9 @@ static void focus(Client *c)
 		attachstack(c);
 		settitle(c);
 		c->urgent = false;
-		if (isarrange(fullscreen)) {
+		if (redraw && isarrange(fullscreen)) {
 			draw(c);
-		} else {
+		} else if (redraw) {
 			draw_border(c);
 			wnoutrefresh(c->window);
 		}
@@ -653,21 +1021,34 @@ static void term_title_handler(Vt *term, const char *handling_title)
 	if (handling_title)
 		strncpy(c->title, handling_title, sizeof(c->title) - 1);
 	c->title[handling_title ? sizeof(c->title) - 1 : 0] = '\0';
-	settitle(c);
-	if (!isarrange(fullscreen) || sel == c)
-		draw_border(c);
-	applycolorrules(c);
+	c->title_changed = true;
 }
 
 static void term_urgent_handler(Vt *term)
 {
 	Client *c = (Client *)vt_data_get(term);
-	c->urgent = true;
-	putc('\a', stdout);
-	fflush(stdout);
-	drawbar();
-	if (!isarrange(fullscreen) && sel != c && isvisible(c))
-		draw_border(c);
+	c->bell = true;
+}
+
+/* applies what the terminal callbacks recorded */
+static void handle_term(Client *c)
+{
+	if (c->title_changed) {
+		c->title_changed = false;
+		settitle(c);
+		if (!isarrange(fullscreen) || sel == c)
+			draw_border(c);
+		applycolorrules(c);
+	}
+	if (c->bell) {
+		c->bell = false;
+		c->urgent = true;
+		putc('\a', stdout);
+		fflush(stdout);
+		drawbar();
+		if (!isarrange(fullscreen) && sel != c && isvisible(c))
+			draw_border(c);
+	}
 }
 
 static void move_client(Client *c, int x, int y)
@@ -698,9 +1079,9 @@ static void resize_client(Client *c, int w, int h)
 	}
 	if (resize_window || c->has_title_line != has_title_line) {
 		c->has_title_line = has_title_line;
-		vt_resize(c->app, h - has_title_line, w);
-		if (c->editor)
-			vt_resize(c->editor, h - has_title_line, w);
+		/* applications whose content is not visible keep their size
+		 * until they are drawn again, see resize_pty() */
+		c->need_resize = true;
 	}
 }
 
@@ -727,11 +1108,13 @@ static Client *get_client_by_coord(int x, int y)
 	return NULL;
 }
 
-static void sigchld_handler(int sig)
+#ifndef __linux__
+static void signal_handler(int sig)
 {
-	(void)sig;
-	write(sigchld_pipe[PIPE_WRITE], "\0", 1);
+	unsigned char signo = sig;
+	write(signal_pipe[PIPE_WRITE], &signo, 1);
 }
+#endif
 
 static void handle_sigchld(void)
 {
@@ -754,10 +1137,12 @@ static void handle_sigchld(void)
 		for (Client *c = clients; c; c = c->next) {
 			if (c->pid == pid) {
 				c->died = true;
+				notice(c);
 				break;
 			}
 			if (c->editor && vt_pid_get(c->editor) == pid) {
 				c->editor_died = true;
+				notice(c);
 				break;
 			}
 		}
@@ -766,15 +1151,42 @@ static void handle_sigchld(void)
 	errno = errsv;
 }
 
-static void sigwinch_handler(int sig)
+static void handle_sigwinch(void)
 {
-	(void)sig;
-	write(sigwinch_pipe[PIPE_WRITE], "\0", 1);
+	/* until the resizing stops frames are drawn at the old size */
+	screen.need_resize = true;
+	screen.resize_at = timestamp() + RESIZE_DELAY;
 }
 
-static void handle_sigwinch(void)
+static void handle_signal(int sig)
 {
-	screen.need_resize = true;
+	switch (sig) {
+	case SIGWINCH:
+		handle_sigwinch();
+		break;
+	case SIGCHLD:
+		handle_sigchld();
+		break;
+	}
+}
+
+static void handle_signals(void)
+{
+#ifdef __linux__
+	struct signalfd_siginfo info[16];
+	ssize_t len;
+	while ((len = read(signal_fd, info, sizeof(info))) > 0) {
+		for (size_t i = 0; i < len / sizeof(*info); i++)
+			handle_signal(info[i].ssi_signo);
+	}
+#else
+	unsigned char buf[256];
+	ssize_t len;
+	while ((len = read(signal_fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < len; i++)
+			handle_signal(buf[i]);
+	}
+#endif
 }
 
 static void sigterm_handler(int sig)
@@ -844,6 +1256,13 @@ static void resize_screen(void)
 
 static void sigsegv_handler(int sig)
 {
+	if (output.fd >= 0)
+		dup2(output.fd, STDOUT_FILENO);
+	/* the same as cleanup(), but without stdio */
+	ssize_t ret = write(STDOUT_FILENO, "\033[?2004l", 8);
+	if (keyboard.csiu)
+		ret = write(STDOUT_FILENO, "\033[<u", 4);
+	(void)ret;
 	vt_shutdown();
 	endwin();
 
@@ -1034,40 +1453,143 @@ static void viewprevtag(const char *args[])
 	tagschanged();
 }
 
-static void keypress(int code)
+/* the pasted text is read as is and handed to the applications at once,
+ * with key bindings and curses' key sequences disabled meanwhile */
+static void pty_queued(Vt *term);
+
+static void paste_end(void)
 {
-	int key = -1;
-	unsigned int len = 1;
-	char buf[8] = { '\e' };
+	pasting = false;
+	/* a broadcast paste is copied and enclosed in markers only once */
+	VtChunk *chunk = runinall ? vt_chunk_new(pasted.data, pasted.len) : NULL;
+	for (Client *c = runinall ? nextvisible(clients) : sel; c;
+	     c = nextvisible(c->next)) {
+		if (is_content_visible(c)) {
+			c->urgent = false;
+			if (chunk)
+				vt_paste_chunk(c->term, chunk);
+			else
+				vt_paste(c->term, pasted.data, pasted.len);
+			pty_queued(c->term);
+		}
+		if (!runinall)
+			break;
+	}
+	vt_chunk_put(chunk);
+	pasted.len = 0;
+}
 
-	if (code == '\e') {
-		/* pass characters following escape to the underlying app */
-		nodelay(stdscr, TRUE);
-		for (int t; len < sizeof(buf) && (t = getch()) != ERR; len++) {
-			if (t > 255) {
-				key = t;
-				break;
-			}
-			buf[len] = t;
+static void paste_add(char ch)
+{
+	if (pasted.len == pasted.size) {
+		size_t size = pasted.size ? 2 * pasted.size : BUFSIZ;
+		char *data = realloc(pasted.data, size);
+		if (!data) {
+			/* without its end marker the rest arrives as typed */
+			paste_end();
+			return;
+		}
+		pasted.data = data;
+		pasted.size = size;
+	}
+	pasted.data[pasted.len++] = ch;
+	if (pasted.len < 6 || memcmp(pasted.data + pasted.len - 6, "\e[201~", 6))
+		return;
+
+	pasted.len -= 6;
+	paste_end();
+}
+
+static void paste_collect(void)
+{
+	nodelay(stdscr, TRUE);
+	for (int t; pasting && (t = getch()) != ERR;)
+		paste_add(t);
+	nodelay(stdscr, FALSE);
+	if (!pasting)
+		keypad(stdscr, TRUE);
+}
+
+static void paste_begin(void)
+{
+	pasting = true;
+	pasted.len = 0;
+	keypad(stdscr, FALSE);
+	paste_collect();
+}
+
+/* sends keys which were typed in a row to the applications at once */
+static void type(const int typed[], unsigned int count)
+{
+	if (!count)
+		return;
+	for (Client *c = runinall ? nextvisible(clients) : sel; c;
+	     c = nextvisible(c->next)) {
+		if (is_content_visible(c)) {
+			c->urgent = false;
+			vt_keypresses(c->term, typed, count);
+			pty_queued(c->term);
 		}
-		nodelay(stdscr, FALSE);
+		if (!runinall)
+			break;
 	}
+}
 
+/* sends input which needs no translation to the applications */
+static void input_write(const char *buf, size_t len)
+{
+	if (!len)
+		return;
+	/* a broadcast which can not be written right away is queued only once */
+	VtChunk *chunk = runinall ? vt_chunk_new(buf, len) : NULL;
 	for (Client *c = runinall ? nextvisible(clients) : sel; c;
 	     c = nextvisible(c->next)) {
 		if (is_content_visible(c)) {
 			c->urgent = false;
-			if (code == '\e')
-				vt_write(c->term, buf, len);
+			vt_noscroll(c->term);
+			if (chunk)
+				vt_write_chunk(c->term, chunk);
 			else
-				vt_keypress(c->term, code);
-
-			if (key >= 0)
-				vt_keypress(c->term, key);
+				vt_write(c->term, buf, len);
+			pty_queued(c->term);
 		}
 		if (!runinall)
 			break;
 	}
+	vt_chunk_put(chunk);
+}
+
+static void keypress(int code)
+{
+	int key = -1;
+	unsigned int len = 1;
+	char buf[8] = { '\e' };
+
+	if (code != '\e') {
+		type(&code, 1);
+		return;
+	}
+
+	/* pass characters following escape to the underlying app */
+	nodelay(stdscr, TRUE);
+	for (int t; len < sizeof(buf) && (t = getch()) != ERR; len++) {
+		if (t > 255) {
+			key = t;
+			break;
+		}
+		buf[len] = t;
+		/* the outer terminal starts a bracketed paste */
+		if (len == 5 && !memcmp(buf, "\e[200~", 6)) {
+			nodelay(stdscr, FALSE);
+			paste_begin();
+			return;
+		}
+	}
+	nodelay(stdscr, FALSE);
+
+	input_write(buf, len);
+	if (key >= 0)
+		type(&key, 1);
 }
 
 static void mouse_setup(void)
@@ -1116,55 +1638,1251 @@ static bool set_blocking(int fd, bool blocking)
 	return fcntl(fd, F_SETFL, flags) == 0;
 }
 
-static void setup(void)
+static bool set_cloexec(int fd)
 {
-	int *pipes[] = { &sigwinch_pipe[PIPE_READ], &sigchld_pipe[PIPE_READ] };
+	int flags = fcntl(fd, F_GETFD, 0);
+	return flags >= 0 && fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == 0;
+}
 
-	for (unsigned int i = 0; i < countof(pipes); i++) {
-		int r = pipe(pipes[i]);
+static void *event_source(int source)
+{
+	return &events.sources[source];
+}
 
-		if (r < 0) {
-			perror("pipe()");
-			exit(EXIT_FAILURE);
-		}
-		for (unsigned int j = 0; j < countof(pipes); j++) {
-			if (!set_blocking(pipes[i][j], false)) {
-				perror("fcntl()");
-				exit(EXIT_FAILURE);
-			}
+static bool event_add(int fd, void *data)
+{
+	if (fd < 0)
+		return false;
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = data };
+	if (epoll_ctl(events.fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		/* a regular file or /dev/null, e.g. stdin, is always ready */
+		if (errno == EPERM && events.nalways < countof(events.always)) {
+			events.always[events.nalways].fd = fd;
+			events.always[events.nalways++].data = data;
+			return true;
 		}
+		eprint("epoll_ctl(): %s\n", strerror(errno));
+		return false;
+	}
+#else
+	if (fd >= FD_SETSIZE)
+		return false;
+	if (events.count == events.size) {
+		unsigned int size = events.size ? 2 * events.size : 64;
+		void *watched = realloc(events.watched, size * sizeof(*events.watched));
+		if (!watched)
+			return false;
+		events.watched = watched;
+		events.size = size;
 	}
+	events.watched[events.count].fd = fd;
+	events.watched[events.count].out = !data;
+	events.watched[events.count++].data = data;
+#endif
+	return true;
+}
 
-	shell = getshell();
-	setlocale(LC_CTYPE, "");
-	initscr();
-	start_color();
-	noecho();
-	nonl();
-	keypad(stdscr, TRUE);
-	mouse_setup();
-	raw();
-	vt_init();
-	vt_keytable_set(keytable, countof(keytable));
-	for (unsigned int i = 0; i < countof(colors); i++) {
-		if (COLORS == 256) {
-			if (colors[i].fg256)
-				colors[i].fg = colors[i].fg256;
-			if (colors[i].bg256)
-				colors[i].bg = colors[i].bg256;
+/* an always ready source which yielded nothing is at its end */
+static void event_drained(int fd)
+{
+#ifdef __linux__
+	for (unsigned int i = 0; i < events.nalways; i++) {
+		if (events.always[i].fd == fd) {
+			events.always[i] = events.always[--events.nalways];
+			break;
 		}
-		colors[i].pair = vt_color_reserve(colors[i].fg, colors[i].bg);
 	}
-	resize_screen();
-
-	struct sigaction sa;
-	memset(&sa, 0, sizeof(sa));
+#endif
+}
 
-	sa.sa_flags = 0;
-	sigemptyset(&sa.sa_mask);
+static void event_del(int fd)
+{
+#ifdef __linux__
+	event_drained(fd);
+	epoll_ctl(events.fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+	for (unsigned int i = 0; i < events.count; i++) {
+		if (events.watched[i].fd == fd && events.watched[i].data) {
+			events.watched[i] = events.watched[--events.count];
+			break;
+		}
+	}
+#endif
+}
 
-#if DVTM_USES_SIGSEGV_HANDLER
-	/* Use SIGSEGV handler for all such signals.  */
+/* writability is reported as a whole through EV_WRITABLE, see handle_writes() */
+static bool event_add_out(int fd, void *data)
+{
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = data };
+	if (epoll_ctl(events.out, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		eprint("epoll_ctl(): %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+#else
+	(void)data;
+	return event_add(fd, NULL);
+#endif
+}
+
+static void event_del_out(int fd)
+{
+#ifdef __linux__
+	epoll_ctl(events.out, EPOLL_CTL_DEL, fd, NULL);
+#else
+	for (unsigned int i = 0; i < events.count; i++) {
+		if (events.watched[i].fd == fd && events.watched[i].out) {
+			events.watched[i] = events.watched[--events.count];
+			break;
+		}
+	}
+#endif
+}
+
+static void pty_hangup(Vt *term)
+{
+	Client *c = vt_data_get(term);
+	if (term == c->editor)
+		c->editor_died = true;
+	else
+		c->died = true;
+	notice(c);
+}
+
+/* the pty of term is watched for becoming writable while input is queued */
+static void pty_watch_out(Vt *term, bool on)
+{
+	Client *c = vt_data_get(term);
+	bool watched = term == c->editor ? c->editor_writing : c->writing;
+	if (on == watched || (on && !event_add_out(vt_pty_get(term), term)))
+		return;
+	if (!on)
+		event_del_out(vt_pty_get(term));
+	if (term == c->editor)
+		c->editor_writing = on;
+	else
+		c->writing = on;
+}
+
+/* input was written to term, what did not fit is written once it is writable */
+static void pty_queued(Vt *term)
+{
+	pty_watch_out(term, vt_write_pending(term));
+}
+
+static void pty_flush(Vt *term)
+{
+	if (vt_write_pending(term) && vt_write_flush(term) < 0 && errno == EIO)
+		pty_hangup(term);
+	pty_queued(term);
+}
+
+/* writes the queued input to the ptys which became writable, as much as the
+ * applications take */
+static void handle_writes(void)
+{
+#ifdef __linux__
+	struct epoll_event evs[64];
+	int n = epoll_wait(events.out, evs, countof(evs), 0);
+	for (int i = 0; i < n; i++)
+		pty_flush(evs[i].data.ptr);
+#else
+	/* select(2) only tells that one of them is writable */
+	for (Client *c = clients; c; c = c->next) {
+		if (c->writing)
+			pty_flush(c->app);
+		if (c->editor_writing)
+			pty_flush(c->editor);
+	}
+#endif
+}
+
+static void rate_refill(Client *c, double now)
+{
+	if (!c->rate)
+		return;
+	c->allowance = MIN(c->allowance + (now - c->allowance_at) * c->rate, c->rate * RATE_BURST);
+	c->allowance_at = now;
+}
+
+/* accounts for output read from a client, which is then looked at in the
+ * main loop. Returns whether it may read more. */
+static bool rate_charge(Client *c, size_t bytes)
+{
+	notice(c);
+	if (!c->rate)
+		return true;
+	rate_refill(c, timestamp());
+	c->allowance -= bytes;
+	return c->allowance > 0;
+}
+
+#if defined(__linux__) && CONFIG_IO_URING
+static int ring_enter(unsigned int submit, unsigned int complete)
+{
+	return syscall(__NR_io_uring_enter, ring.fd, submit, complete,
+	               complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* io_uring(7) exists since Linux 5.1, reading with it only since 5.6 */
+static bool ring_supported(void)
+{
+	const unsigned int ops[] = { IORING_OP_READ, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+	struct io_uring_probe *probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+	bool supported = probe &&
+		syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+	for (unsigned int i = 0; supported && i < countof(ops); i++)
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return supported;
+}
+
+static bool ring_setup(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	/* at most one read and its cancellation are in flight per pty */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4096;
+	if ((ring.fd = syscall(__NR_io_uring_setup, 256, &p)) < 0)
+		return false;
+	if (!ring_supported()) {
+		close(ring.fd);
+		ring.fd = -1;
+		return false;
+	}
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = MAX(sq_len, cq_len);
+	char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_SQ_RING);
+	char *cq = sq;
+	if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	                 PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		close(ring.fd);
+		ring.fd = -1;
+		return false;
+	}
+
+	ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring.sq_entries = p.sq_entries;
+	ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+/* hand all prepared operations to the kernel */
+static void ring_submit(void)
+{
+	while (ring.queued > 0) {
+		int n = ring_enter(ring.queued, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			error("io_uring_enter(): %s\n", strerror(errno));
+		}
+		ring.queued -= n;
+	}
+}
+
+static struct io_uring_sqe *ring_sqe(void)
+{
+	unsigned int tail = *ring.sq_tail;
+	if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) {
+		ring_submit();
+		tail = *ring.sq_tail;
+	}
+	unsigned int index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	return sqe;
+}
+
+static void ring_push(void)
+{
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+}
+
+/* the ptys are non-blocking, a read is only started once one is readable.
+ * The poll is tagged by the lowest bit of the address of its RingRead. */
+static void ring_post(RingRead *r)
+{
+	struct io_uring_sqe *sqe = ring_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = vt_pty_get(r->term);
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->poll_events = POLLIN;
+	sqe->user_data = (uintptr_t)r | 1;
+	ring_push();
+
+	sqe = ring_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = vt_pty_get(r->term);
+	sqe->addr = (uintptr_t)r->buf;
+	sqe->len = sizeof(r->buf);
+	sqe->user_data = (uintptr_t)r;
+	ring_push();
+	r->posted = true;
+}
+
+/* process all completed reads without entering the kernel, returns the
+ * number of bytes read */
+static size_t ring_harvest(void)
+{
+	size_t total = 0;
+	unsigned int head = *ring.cq_head;
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		RingRead *r = (RingRead *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+		__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+		if (!r || ((uintptr_t)r & 1))
+			continue; /* completion of a cancellation or poll */
+		r->posted = false;
+		bool more = true;
+		if (res > 0) {
+			vt_process_data(r->term, r->buf, res);
+			more = rate_charge(vt_data_get(r->term), res);
+			total += res;
+		}
+		/* the read of a throttled client is posted again once it is watched */
+		if (r->removing || !more)
+			continue;
+		if (res > 0 || res == -EAGAIN || res == -EINTR || res == -ECANCELED)
+			ring_post(r);
+		else
+			pty_hangup(r->term);
+	}
+	return total;
+}
+
+/* keep harvesting while the reposted reads complete right away. Every round
+ * reads at most one buffer per pty, so busy ones take turns until READ_BUDGET
+ * bytes or READ_BUDGET_TIME seconds are used up or input arrives. */
+static void ring_drain(void)
+{
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	double deadline = timestamp() + READ_BUDGET_TIME;
+	size_t n, total = 0;
+
+	while ((n = ring_harvest()) > 0) {
+		total += n;
+		if (total >= READ_BUDGET || timestamp() >= deadline || poll(&pfd, 1, 0) > 0)
+			break;
+		ring_submit();
+	}
+}
+#endif
+
+/* a descriptor pair to wake up whoever polls the read end */
+static bool notify_open(int fds[2])
+{
+#ifdef __linux__
+	fds[PIPE_READ] = fds[PIPE_WRITE] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return fds[PIPE_READ] >= 0;
+#else
+	if (pipe(fds) < 0)
+		return false;
+	return set_blocking(fds[PIPE_READ], false) && set_blocking(fds[PIPE_WRITE], false);
+#endif
+}
+
+static void notify_send(int fds[2])
+{
+	uint64_t one = 1;
+	write(fds[PIPE_WRITE], &one, sizeof(one));
+}
+
+static void notify_clear(int fds[2])
+{
+	uint64_t buf[32];
+	while (read(fds[PIPE_READ], buf, sizeof(buf)) > 0)
+		;
+}
+
+/* reads once into the free space of b, returns whether anything changed */
+static bool reader_fill(PtyBuffer *b)
+{
+	size_t head = b->head;
+	size_t space = PTY_BUFFER_SIZE - (head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE));
+	size_t off = head & (PTY_BUFFER_SIZE - 1);
+	if (!space)
+		return false;
+	ssize_t len = read(b->fd, b->buf + off, MIN(space, PTY_BUFFER_SIZE - off));
+	if (len > 0)
+		__atomic_store_n(&b->head, head + len, __ATOMIC_RELEASE);
+	else if (len == 0 || (errno != EINTR && errno != EAGAIN))
+		__atomic_store_n(&b->hangup, true, __ATOMIC_RELEASE);
+	else
+		return false;
+	return true;
+}
+
+static void *reader_thread(void *arg)
+{
+	Reader *rd = arg;
+	struct pollfd *pfds = NULL;
+	PtyBuffer **bufs = NULL;
+	unsigned int size = 0;
+
+	for (;;) {
+		unsigned int n = 1;
+
+		pthread_mutex_lock(&rd->lock);
+		rd->changed = false;
+		for (PtyBuffer *b = rd->buffers; b; b = b->next)
+			n++;
+		if (n > size) {
+			void *p = realloc(pfds, n * sizeof(*pfds)), *q = p ? realloc(bufs, n * sizeof(*bufs)) : NULL;
+			if (p)
+				pfds = p;
+			if (q)
+				bufs = q;
+			if (!p || !q) {
+				pthread_mutex_unlock(&rd->lock);
+				error("out of memory\n");
+			}
+			size = n;
+		}
+		n = 1;
+		pfds[0] = (struct pollfd){ .fd = rd->wake[PIPE_READ], .events = POLLIN };
+		for (PtyBuffer *b = rd->buffers; b; b = b->next) {
+			if (__atomic_load_n(&b->hangup, __ATOMIC_RELAXED))
+				continue;
+			/* announce being full before checking, the main loop
+			 * checks the flag after making room */
+			__atomic_store_n(&b->full, true, __ATOMIC_SEQ_CST);
+			if (b->head - __atomic_load_n(&b->tail, __ATOMIC_SEQ_CST) == PTY_BUFFER_SIZE)
+				continue;
+			__atomic_store_n(&b->full, false, __ATOMIC_RELAXED);
+			pfds[n] = (struct pollfd){ .fd = b->fd, .events = POLLIN };
+			bufs[n++] = b;
+		}
+		pthread_mutex_unlock(&rd->lock);
+
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error("poll(): %s\n", strerror(errno));
+		}
+		if (pfds[0].revents)
+			notify_clear(rd->wake);
+
+		bool arrived = false;
+		pthread_mutex_lock(&rd->lock);
+		/* the buffers polled might be gone */
+		for (unsigned int i = 1; i < n && !rd->changed; i++) {
+			if (pfds[i].revents && reader_fill(bufs[i]))
+				arrived = true;
+		}
+		pthread_mutex_unlock(&rd->lock);
+		if (arrived && !__atomic_exchange_n(&readers.notified, true, __ATOMIC_ACQ_REL))
+			notify_send(readers.notify);
+	}
+
+	return NULL;
+}
+
+/* Read the ptys in PTY_READERS threads, the output is passed to the main
+ * loop through a buffer per pty. This keeps the ptys drained while the main
+ * loop is busy, the applications are only blocked once a buffer is full. */
+static bool readers_start(unsigned int count)
+{
+	sigset_t all, old;
+
+	if (!count || !notify_open(readers.notify) ||
+	    !(readers.threads = calloc(count, sizeof(*readers.threads))))
+		return false;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (unsigned int i = 0; i < count; i++) {
+		Reader *rd = &readers.threads[i];
+		pthread_mutex_init(&rd->lock, NULL);
+		if (!notify_open(rd->wake) ||
+		    pthread_create(&rd->thread, NULL, reader_thread, rd))
+			break;
+		readers.count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return readers.count > 0;
+}
+
+static void readers_clear(void)
+{
+	__atomic_store_n(&readers.notified, false, __ATOMIC_SEQ_CST);
+	notify_clear(readers.notify);
+}
+
+/* feeds at most max bytes of buffered output to the terminal */
+static ssize_t reader_consume(PtyBuffer *b, size_t max)
+{
+	bool hangup = __atomic_load_n(&b->hangup, __ATOMIC_ACQUIRE);
+	size_t tail = b->tail, head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+	size_t total = 0;
+
+	while (tail != head && total < max) {
+		size_t off = tail & (PTY_BUFFER_SIZE - 1);
+		size_t len = MIN(MIN(head - tail, PTY_BUFFER_SIZE - off), max - total);
+		vt_process_data(b->term, b->buf + off, len);
+		tail += len;
+		total += len;
+	}
+	__atomic_store_n(&b->tail, tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&b->full, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&b->full, false, __ATOMIC_SEQ_CST))
+		notify_send(b->reader->wake);
+	if (!total && hangup) {
+		errno = EIO;
+		return -1;
+	}
+	return total;
+}
+
+static PtyBuffer **reader_find(Vt *term)
+{
+	for (unsigned int i = 0; i < readers.count; i++) {
+		for (PtyBuffer **b = &readers.threads[i].buffers; *b; b = &(*b)->next) {
+			if ((*b)->term == term)
+				return b;
+		}
+	}
+	return NULL;
+}
+
+/* watch the pty of term for output which is fed to it */
+static bool pty_watch(Vt *term)
+{
+	if (readers.count) {
+		PtyBuffer *b = calloc(1, sizeof(*b));
+		if (!b)
+			return false;
+		b->term = term;
+		b->fd = vt_pty_get(term);
+		b->reader = &readers.threads[readers.next++ % readers.count];
+		pthread_mutex_lock(&b->reader->lock);
+		b->next = b->reader->buffers;
+		b->reader->buffers = b;
+		b->reader->changed = true;
+		pthread_mutex_unlock(&b->reader->lock);
+		notify_send(b->reader->wake);
+		return true;
+	}
+#if defined(__linux__) && CONFIG_IO_URING
+	if (ring.fd >= 0) {
+		RingRead *r = calloc(1, sizeof(*r));
+		if (!r)
+			return false;
+		r->term = term;
+		r->next = ring.reads;
+		ring.reads = r;
+		ring_post(r);
+		return true;
+	}
+#endif
+	return event_add(vt_pty_get(term), term);
+}
+
+static void pty_unwatch(Vt *term)
+{
+	if (readers.count) {
+		PtyBuffer **p = reader_find(term), *b;
+		if (!p)
+			return;
+		b = *p;
+		pthread_mutex_lock(&b->reader->lock);
+		*p = b->next;
+		b->reader->changed = true;
+		pthread_mutex_unlock(&b->reader->lock);
+		notify_send(b->reader->wake);
+		/* output which already arrived is still processed */
+		reader_consume(b, SIZE_MAX);
+		free(b);
+		return;
+	}
+#if defined(__linux__) && CONFIG_IO_URING
+	if (ring.fd >= 0) {
+		RingRead **r;
+		for (r = &ring.reads; *r && (*r)->term != term; r = &(*r)->next);
+		if (!*r)
+			return;
+		RingRead *t = *r;
+		t->removing = true;
+		if (t->posted) {
+			struct io_uring_sqe *sqe = ring_sqe();
+			/* cancels the read linked to the poll as well */
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uintptr_t)t | 1;
+			ring_push();
+		}
+		/* output which already arrived is still processed */
+		while (t->posted) {
+			int n = ring_enter(ring.queued, 1);
+			if (n < 0 && errno != EINTR)
+				error("io_uring_enter(): %s\n", strerror(errno));
+			if (n > 0)
+				ring.queued -= n;
+			ring_harvest();
+		}
+		*r = t->next;
+		free(t);
+		return;
+	}
+#endif
+	event_del(vt_pty_get(term));
+}
+
+/* the output of a throttled client is left in the kernel, or in the buffer
+ * of its reader until that is full */
+static void throttle(Client *c, bool on)
+{
+	if (c->throttled == on)
+		return;
+	c->throttled = on;
+	/* it is looked at until it may read again */
+	notice(c);
+	if (readers.count)
+		return;
+	if (on)
+		pty_unwatch(c->term);
+	else if (!pty_watch(c->term))
+		c->died = true;
+}
+
+/* reads at most max bytes of output of a ready pty, see vt_process() */
+static ssize_t pty_process(Vt *term, size_t max)
+{
+	if (readers.count) {
+		PtyBuffer **b = reader_find(term);
+		if (!b) {
+			errno = EINVAL;
+			return -1;
+		}
+		return reader_consume(*b, max);
+	}
+	return vt_process(term, max);
+}
+
+/* works on the jobs of the current round, called with parsers.lock held */
+static void parse_jobs(void)
+{
+	while (parsers.next < parsers.njobs) {
+		ParseJob *job = &parsers.jobs[parsers.next++];
+		pthread_mutex_unlock(&parsers.lock);
+		parsers.run(job);
+		pthread_mutex_lock(&parsers.lock);
+		if (++parsers.done == parsers.njobs)
+			pthread_cond_broadcast(&parsers.finish);
+	}
+}
+
+static void *parser_thread(void *arg)
+{
+	pthread_mutex_lock(&parsers.lock);
+	for (;;) {
+		while (parsers.next >= parsers.njobs)
+			pthread_cond_wait(&parsers.start, &parsers.lock);
+		parse_jobs();
+	}
+	return NULL;
+}
+
+/* The output of busy clients is parsed by PARSE_THREADS threads in addition
+ * to the main one, they also find the rows which have to be redrawn. Each
+ * round of jobs is completed before the main loop goes on, so nothing is
+ * drawn while a terminal is being changed. */
+static void parsers_start(unsigned int count)
+{
+	sigset_t all, old;
+
+	if (!count || !(parsers.threads = calloc(count, sizeof(*parsers.threads))))
+		return;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (unsigned int i = 0; i < count; i++) {
+		if (pthread_create(&parsers.threads[i], NULL, parser_thread, NULL))
+			break;
+		parsers.count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* runs a round of jobs, spread over the parser threads if there are any */
+static void parse_round(ParseJob jobs[], unsigned int n, void (*run)(ParseJob *))
+{
+	if (!parsers.count || n < 2) {
+		for (unsigned int i = 0; i < n; i++)
+			run(&jobs[i]);
+		return;
+	}
+	pthread_mutex_lock(&parsers.lock);
+	parsers.run = run;
+	parsers.jobs = jobs;
+	parsers.njobs = n;
+	parsers.next = parsers.done = 0;
+	pthread_cond_broadcast(&parsers.start);
+	parse_jobs();
+	while (parsers.done < parsers.njobs)
+		pthread_cond_wait(&parsers.finish, &parsers.lock);
+	pthread_mutex_unlock(&parsers.lock);
+}
+
+/* waits at most timeout seconds for output of term */
+static bool pty_wait(Vt *term, double timeout)
+{
+	struct pollfd pfd = { .fd = vt_pty_get(term), .events = POLLIN };
+	double deadline = timestamp() + timeout;
+
+	if (!readers.count)
+		return poll(&pfd, 1, timeout * 1000) > 0;
+
+	PtyBuffer **b = reader_find(term);
+	pfd.fd = readers.notify[PIPE_READ];
+	while (b && (*b)->tail == __atomic_load_n(&(*b)->head, __ATOMIC_ACQUIRE)) {
+		int ms = (deadline - timestamp()) * 1000;
+		if (ms <= 0 || poll(&pfd, 1, ms) <= 0)
+			return false;
+		readers_clear();
+	}
+	return b;
+}
+
+/* adds the ptys whose output was buffered by the readers to ready */
+static int pty_buffered(Vt *ready[], int n, int max)
+{
+	for (unsigned int i = 0; i < readers.count; i++) {
+		for (PtyBuffer *b = readers.threads[i].buffers; b && n < max; b = b->next) {
+			Client *c = vt_data_get(b->term);
+			if (c->throttled)
+				continue;
+			if (b->tail != __atomic_load_n(&b->head, __ATOMIC_ACQUIRE) ||
+			    __atomic_load_n(&b->hangup, __ATOMIC_ACQUIRE))
+				ready[n++] = b->term;
+		}
+	}
+	return n;
+}
+
+/* wait until either of the registered file descriptors becomes readable or
+ * the timeout in seconds expires, a negative one blocks indefinitely. The
+ * tags of at most max ready ones are stored in ready. */
+static int event_wait(void *ready[], int max, double timeout)
+{
+#if defined(__linux__) && CONFIG_IO_URING
+	if (ring.fd >= 0)
+		ring_submit();
+#endif
+#ifdef __linux__
+	struct epoll_event evs[max];
+	if (events.nalways)
+		timeout = 0;
+	int n = epoll_wait(events.fd, evs, max, timeout < 0 ? -1 : (int)(timeout * 1000 + 0.999));
+	for (int i = 0; i < n; i++)
+		ready[i] = evs[i].data.ptr;
+	for (unsigned int i = 0; n >= 0 && i < events.nalways && n < max; i++)
+		ready[n++] = events.always[i].data;
+	return n;
+#else
+	fd_set rd, wr;
+	int n, nfds = -1;
+	bool writable = false;
+	struct timeval tv = { .tv_sec = timeout, .tv_usec = (timeout - (long)timeout) * 1e6 };
+
+	FD_ZERO(&rd);
+	FD_ZERO(&wr);
+	for (unsigned int i = 0; i < events.count; i++) {
+		FD_SET(events.watched[i].fd, events.watched[i].out ? &wr : &rd);
+		nfds = MAX(nfds, events.watched[i].fd);
+	}
+	if ((n = select(nfds + 1, &rd, &wr, NULL, timeout < 0 ? NULL : &tv)) <= 0)
+		return n;
+	n = 0;
+	for (unsigned int i = 0; i < events.count && n < max; i++) {
+		if (events.watched[i].out)
+			writable |= FD_ISSET(events.watched[i].fd, &wr);
+		else if (FD_ISSET(events.watched[i].fd, &rd))
+			ready[n++] = events.watched[i].data;
+	}
+	if (writable && n < max)
+		ready[n++] = event_source(EV_WRITABLE);
+	return n;
+#endif
+}
+
+static size_t output_backlog(void)
+{
+	int len;
+	if (ioctl(output.pipe[PIPE_READ], FIONREAD, &len) < 0 || len < 0)
+		return 0;
+	return len;
+}
+
+/* bytes of earlier frames which are not yet written to the terminal */
+static size_t output_pending(void)
+{
+	pthread_mutex_lock(&output.lock);
+	size_t pending = output.queued + output_backlog();
+	pthread_mutex_unlock(&output.lock);
+	return pending;
+}
+
+/* bytes written to the terminal which it did not yet read */
+static size_t output_unread(void)
+{
+#ifdef TIOCOUTQ
+	int len;
+	if (ioctl(output.tty, TIOCOUTQ, &len) == 0 && len > 0)
+		return len;
+#endif
+	return 0;
+}
+
+/* Moves the output of curses from pipe to a queue as soon as it arrives and
+ * writes the queue to the terminal whenever that accepts more. Curses thus
+ * only has to wait once OUTPUT_QUEUE_MAX bytes are queued. */
+static void *output_thread(void *arg)
+{
+	char *queue = NULL;
+	size_t start = 0, len = 0, size = 0;
+	bool eof = false;
+	/* Exponentially decaying sums of bytes the terminal read and the time
+	 * it took, measured from the first byte queued until the queue is empty
+	 * again. Writes complete once the kernel buffered the data, what the
+	 * terminal did not read by then is not counted. */
+	double bytes = 0, secs = 0, busy = 0, written = 0, unread = 0;
+	struct pollfd pfd[2] = {
+		{ .fd = output.pipe[PIPE_READ], .events = POLLIN },
+		{ .fd = output.tty, .events = POLLOUT },
+	};
+
+	while (!eof || len) {
+		if (!eof && start + len == size && size < OUTPUT_QUEUE_MAX) {
+			size_t grown = MIN(MAX(2 * size, BUFSIZ * 8), OUTPUT_QUEUE_MAX);
+			char *q = realloc(queue, grown);
+			if (q) {
+				queue = q;
+				size = grown;
+			}
+		}
+		if (start && start + len == size) {
+			memmove(queue, queue + start, len);
+			start = 0;
+		}
+		pfd[0].fd = !eof && start + len < size ? output.pipe[PIPE_READ] : -1;
+		pfd[1].fd = len ? output.tty : -1;
+		if (pfd[0].fd < 0 && pfd[1].fd < 0)
+			break; /* out of memory */
+		if (poll(pfd, countof(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents) {
+			pthread_mutex_lock(&output.lock);
+			ssize_t n = read(output.pipe[PIPE_READ], queue + start + len, size - start - len);
+			if (n > 0) {
+				if (!len) {
+					busy = timestamp();
+					unread = output_unread();
+				}
+				len += n;
+				output.total += n;
+				output.queued = len;
+			} else if (!n || (errno != EINTR && errno != EAGAIN)) {
+				eof = true; /* stdout was restored by output_stop() */
+			}
+			pthread_mutex_unlock(&output.lock);
+		}
+
+		if (pfd[1].revents) {
+			ssize_t n = write(output.tty, queue + start, len);
+			if (n > 0) {
+				start += n;
+				len -= n;
+				written += n;
+			} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				len = 0; /* terminal is gone, discard */
+			}
+			if (!len) {
+				start = 0;
+				bytes = bytes * 0.9 + MAX(written + unread - output_unread(), 0);
+				secs = secs * 0.9 + (timestamp() - busy);
+				written = 0;
+			}
+			pthread_mutex_lock(&output.lock);
+			output.queued = len;
+			if (!len)
+				output.rate = secs > 0 ? bytes / secs : 0;
+			bool idle = !output.queued && !output_backlog();
+			pthread_mutex_unlock(&output.lock);
+			if (idle)
+				write(output.idle_pipe[PIPE_WRITE], "\0", 1);
+		}
+	}
+
+	free(queue);
+	return NULL;
+}
+
+/* Send query to the terminal followed by a primary device attributes
+ * request, which every terminal answers. Collect the control sequences
+ * received until then in reply, everything else is typeahead which is
+ * kept for the input handlers, see typeahead_take().
+ */
+static void terminal_query(const char *query, char *reply, size_t size)
+{
+	char buf[sizeof(keyboard.typeahead)];
+	size_t len = 0, rlen = 0;
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	double deadline = timestamp() + 0.1;
+	bool answered = false;
+
+	*reply = '\0';
+	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+		return;
+	fflush(stdout);
+	if (write(STDOUT_FILENO, query, strlen(query)) < 0 ||
+	    write(STDOUT_FILENO, "\033[c", 3) < 0)
+		return;
+
+	while (!answered && len < sizeof(buf)) {
+		int ms = (deadline - timestamp()) * 1000;
+		if (ms <= 0 || poll(&pfd, 1, ms) <= 0)
+			break;
+		ssize_t r = read(STDIN_FILENO, buf + len, sizeof(buf) - len);
+		if (r <= 0)
+			break;
+		len += r;
+		/* look for the device attributes, i.e. ESC [ ? ... c */
+		for (size_t i = 0; i + 2 < len && !answered; i++) {
+			if (buf[i] != '\033' || buf[i + 1] != '[' || buf[i + 2] != '?')
+				continue;
+			size_t j = i + 3;
+			while (j < len && (isdigit((unsigned char)buf[j]) || buf[j] == ';'))
+				j++;
+			answered = j < len && buf[j] == 'c';
+		}
+	}
+
+	for (size_t i = 0; i < len;) {
+		size_t j = i;
+		if (buf[i] == '\033' && i + 1 < len && buf[i + 1] == '[') {
+			/* skip parameter and intermediate bytes, then the final one */
+			for (j = i + 2; j < len && (buf[j] < 0x40 || buf[j] > 0x7e); j++)
+				;
+		}
+		if (j == i || j == len) {
+			keyboard.typeahead[keyboard.typeahead_len++] = buf[i++];
+			continue;
+		}
+		j++;
+		if (rlen + (j - i) < size) {
+			memcpy(reply + rlen, buf + i, j - i);
+			rlen += j - i;
+			reply[rlen] = '\0';
+		}
+		i = j;
+	}
+}
+
+/* takes at most size bytes of what terminal_query() kept */
+static size_t typeahead_take(char *buf, size_t size)
+{
+	size_t n = MIN(keyboard.typeahead_len, size);
+	memcpy(buf, keyboard.typeahead, n);
+	keyboard.typeahead_len -= n;
+	memmove(keyboard.typeahead, keyboard.typeahead + n, keyboard.typeahead_len);
+	return n;
+}
+
+/* the terminal reports the enabled flags of the kitty keyboard protocol */
+static bool terminal_has_csiu(const char *reply)
+{
+	const char *r = reply;
+
+	while ((r = strstr(r, "\033[?"))) {
+		r += 3;
+		while (isdigit((unsigned char)*r))
+			r++;
+		if (*r == 'u')
+			return true;
+	}
+	return false;
+}
+
+/* DECRQM, the terminal reports 1 (set) or 2 (reset) if it knows the mode */
+static bool terminal_has_sync(const char *reply)
+{
+	const char *cap = tigetstr("Sync");
+
+	if (cap && cap != (char *)-1)
+		return true;
+	return strstr(reply, "\033[?2026;1$y") || strstr(reply, "\033[?2026;2$y");
+}
+
+/* all the queries share a single round trip to the terminal */
+static void terminal_probe(void)
+{
+	char reply[512];
+
+	terminal_query("\033[?u\033[?2026$p", reply, sizeof(reply));
+	output.sync = terminal_has_sync(reply);
+	keyboard.csiu = terminal_has_csiu(reply);
+}
+
+/* Redirect everything written to stdout, most notably the output of
+ * doupdate(), through a pipe which is drained by a separate thread.
+ * This way a slow outer terminal never blocks the main loop.
+ */
+static void output_start(void)
+{
+	sigset_t all, old;
+
+	fflush(stdout);
+	if ((output.fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0)) < 0)
+		return;
+	/* stdin shares the flags of the original descriptor, open another one */
+	const char *tty = ttyname(STDOUT_FILENO);
+	if (!tty || (output.tty = open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		output.tty = output.fd;
+#ifdef F_SETPIPE_SZ
+	/* fewer wakeups of the writer thread, a small pipe only costs those */
+	if (fcntl(output.pipe[PIPE_WRITE], F_SETPIPE_SZ, 1 << 20) < 0) {
+		debug("F_SETPIPE_SZ: %s\n", strerror(errno));
+	}
+#endif
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&output.thread, NULL, output_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		if (output.tty != output.fd)
+			close(output.tty);
+		close(output.fd);
+		output.fd = -1;
+		return;
+	}
+	dup2(output.pipe[PIPE_WRITE], STDOUT_FILENO);
+	close(output.pipe[PIPE_WRITE]);
+	output.pipe[PIPE_WRITE] = -1;
+}
+
+/* flush pending output and write directly to the terminal again */
+static void output_stop(void)
+{
+	if (output.fd < 0)
+		return;
+	fflush(stdout);
+	dup2(output.fd, STDOUT_FILENO);
+	pthread_join(output.thread, NULL);
+	if (output.tty != output.fd)
+		close(output.tty);
+	close(output.fd);
+	output.fd = -1;
+}
+
+static double output_rate(void)
+{
+	pthread_mutex_lock(&output.lock);
+	double rate = output.rate;
+	pthread_mutex_unlock(&output.lock);
+	return rate;
+}
+
+static size_t output_total(void)
+{
+	pthread_mutex_lock(&output.lock);
+	size_t total = output.total;
+	pthread_mutex_unlock(&output.lock);
+	return total;
+}
+
+static bool output_fast(void)
+{
+	double rate = output_rate();
+	return !rate || rate >= OUTPUT_FAST_RATE;
+}
+
+/* Output the current frame unless the previous one is still being written,
+ * in which case it is dropped. Curses keeps track of the changes and they
+ * will be part of the next frame written once the writer thread is idle.
+ *
+ * The writes of the thread complete as soon as the data is buffered by the
+ * kernel, on slow connections those buffers fill up and the screen would lag
+ * behind. Hence frames are additionally spaced by the time the terminal needs
+ * to process them at the measured rate.
+ */
+static void output_frame(void)
+{
+	if (output.fd >= 0 && output_pending())
+		return;
+
+	double now = timestamp();
+	if (now < output.next_frame) {
+		wakeup_at(output.next_frame);
+		return;
+	}
+
+	size_t total = output.fd >= 0 ? output_total() : 0;
+	/* have the terminal present the frame at once instead of in pieces */
+	bool sync = output.sync && is_wintouched(newscr);
+	if (sync) {
+		fputs("\033[?2026h", stdout);
+		fflush(stdout);
+	}
+	doupdate();
+	vt_color_frame();
+	output.urgent = false;
+	if (sync) {
+		fputs("\033[?2026l", stdout);
+		fflush(stdout);
+	}
+	if (output.fd < 0)
+		return;
+
+	size_t bytes = output_total() - total + output_backlog();
+	double rate = output_rate();
+	output.next_frame = rate ? now + bytes / rate : 0;
+}
+
+static void handle_output_idle(void)
+{
+	char buf[256];
+	/* the main loop was woken up, output_frame() sees that it is idle */
+	while (read(output.idle_pipe[PIPE_READ], &buf, sizeof(buf)) > 0)
+		;
+}
+
+static void setup(void)
+{
+	int *pipes[] = {
+		&output.idle_pipe[PIPE_READ],
+#ifndef __linux__
+		&signal_pipe[PIPE_READ],
+#endif
+	};
+
+	for (unsigned int i = 0; i < countof(pipes); i++) {
+		int r = pipe(pipes[i]);
+
+		if (r < 0) {
+			perror("pipe()");
+			exit(EXIT_FAILURE);
+		}
+		for (unsigned int j = PIPE_READ; j <= PIPE_WRITE; j++) {
+			if (!set_blocking(pipes[i][j], false) || !set_cloexec(pipes[i][j])) {
+				perror("fcntl()");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (pipe(output.pipe) < 0 || !set_cloexec(output.pipe[PIPE_READ]) ||
+	    !set_cloexec(output.pipe[PIPE_WRITE])) {
+		perror("pipe()");
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef __linux__
+	/* SIGWINCH and SIGCHLD are read from signal_fd, the children
+	 * reset their signal mask after forking */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 ||
+	    (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		perror("signalfd()");
+		exit(EXIT_FAILURE);
+	}
+	if ((events.fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+	    (events.out = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+	if (!event_add(events.out, event_source(EV_WRITABLE)))
+		error("failed to set up the event loop\n");
+#if CONFIG_IO_URING
+	/* without io_uring(7) the ptys are polled like any other descriptor */
+	if (!PTY_READERS && ring_setup() && !event_add(ring.fd, event_source(EV_RING)))
+		error("failed to set up the event loop\n");
+#endif
+#else
+	signal_fd = signal_pipe[PIPE_READ];
+#endif
+	if (!event_add(STDIN_FILENO, event_source(EV_STDIN)) ||
+	    !event_add(signal_fd, event_source(EV_SIGNAL)) ||
+	    !event_add(output.idle_pipe[PIPE_READ], event_source(EV_OUTPUT)) ||
+	    (cmdfifo.fd >= 0 && !event_add(cmdfifo.fd, event_source(EV_CMDFIFO))) ||
+	    (bar.fd >= 0 && !event_add(bar.fd, event_source(EV_STATUSBAR))) ||
+	    (readers_start(PTY_READERS) && !event_add(readers.notify[PIPE_READ], event_source(EV_READER))))
+		error("failed to set up the event loop\n");
+	parsers_start(PARSE_THREADS);
+
+	shell = getshell();
+	setlocale(LC_CTYPE, "");
+	initscr();
+	/* curses never waits after an escape, held escapes expire in the
+	 * main loop instead, see escape_read() */
+	keyboard.delay = ESCDELAY / 1000.0;
+	set_escdelay(0);
+	start_color();
+	noecho();
+	nonl();
+	keypad(stdscr, TRUE);
+	if (RAW_INPUT) {
+		/* keybound() needs the key definitions loaded by keypad() */
+		raw_setup();
+		keypad(stdscr, FALSE);
+	} else {
+		mouse_setup();
+	}
+	raw();
+	vt_init();
+	vt_keytable_set(keytable, countof(keytable));
+	vt_strict_compare_set(STRICT_ROW_COMPARE);
+	vt_render_concurrent_set(parsers.count);
+	terminal_probe();
+	output_start();
+	/* pastes are forwarded in one piece, see paste_collect() */
+	fputs("\033[?2004h", stdout);
+	/* an escape is then always told apart from the start of a sequence */
+	if (keyboard.csiu)
+		fputs("\033[>1u", stdout);
+	fflush(stdout);
+	for (unsigned int i = 0; i < countof(colors); i++) {
+		if (COLORS >= 256) {
+			if (colors[i].fg256)
+				colors[i].fg = colors[i].fg256;
+			if (colors[i].bg256)
+				colors[i].bg = colors[i].bg256;
+		}
+		colors[i].pair = vt_color_reserve(colors[i].fg, colors[i].bg);
+	}
+	resize_screen();
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+
+#if DVTM_USES_SIGSEGV_HANDLER
+	/* Use SIGSEGV handler for all such signals.  */
 	sa.sa_handler = sigsegv_handler;
 
 	sigaction(SIGSEGV, &sa, NULL);
@@ -1179,10 +2897,12 @@ static void setup(void)
 # endif
 #endif
 
-	sa.sa_handler = sigwinch_handler;
+#ifdef __linux__
+	sa.sa_handler = SIG_DFL;
+#else
+	sa.sa_handler = signal_handler;
+#endif
 	sigaction(SIGWINCH, &sa, NULL);
-
-	sa.sa_handler = sigchld_handler;
 	sigaction(SIGCHLD, &sa, NULL);
 
 	sa.sa_handler = sigterm_handler;
@@ -1217,8 +2937,13 @@ static void destroy(Client *c)
 
 	werase(c->window);
 	wnoutrefresh(c->window);
+	pty_unwatch(c->term);
+	pty_watch_out(c->app, false);
+	if (c->editor)
+		pty_watch_out(c->editor, false);
 	vt_destroy(c->term);
 	delwin(c->window);
+	unnotice(c);
 
 	if (!clients && countof(actions)) {
 		if (!strcmp(c->cmd, shell))
@@ -1233,6 +2958,15 @@ static void destroy(Client *c)
 
 static void cleanup(void)
 {
+	unsigned long hits, misses, evictions;
+	vt_color_stats(&hits, &misses, &evictions);
+	debug("color pairs: %lu hits, %lu misses, %lu evictions\n",
+	      hits, misses, evictions);
+
+	output_stop();
+	fputs("\033[?2004l", stdout);
+	if (keyboard.csiu)
+		fputs("\033[<u", stdout);
 	vt_shutdown();
 	endwin();
 
@@ -1240,6 +2974,7 @@ static void cleanup(void)
 	puts("\r");
 
 	free(copyreg.data);
+	free(pasted.data);
 
 	if (bar.fd >= 0)
 		close(bar.fd);
@@ -1281,6 +3016,9 @@ static void create(const char *args[])
 		return;
 	c->tags = tagset[seltags];
 	c->id = ++cmdfifo.id;
+	c->rate = RATE_LIMIT;
+	c->allowance = c->rate * RATE_BURST;
+	c->allowance_at = timestamp();
 	snprintf(buf, sizeof(buf), "%d", c->id);
 
 	if (!(c->window = newwin(wah, waw, way, wax))) {
@@ -1315,6 +3053,12 @@ static void create(const char *args[])
 	c->pid = vt_forkpty(c->term, shell, pargs, cwd, env, NULL, NULL);
 	if (args && args[2] && !strcmp(args[2], "$CWD"))
 		free(cwd);
+	if (!pty_watch(c->term)) {
+		vt_destroy(c->term);
+		delwin(c->window);
+		free(c);
+		return;
+	}
 	vt_data_set(c->term, c);
 	vt_title_handler_set(c->term, term_title_handler);
 	vt_urgent_handler_set(c->term, term_urgent_handler);
@@ -1327,6 +3071,15 @@ static void create(const char *args[])
 	arrange();
 }
 
+static void colorstats(const char *args[])
+{
+	unsigned long hits, misses, evictions;
+	vt_color_stats(&hits, &misses, &evictions);
+	snprintf(bar.text, sizeof(bar.text), "color pairs: %lu hits, %lu misses, %lu evictions",
+		 hits, misses, evictions);
+	drawbar();
+}
+
 static void copymode(const char *args[])
 {
 	if (!args || !args[0] || !sel || sel->editor)
@@ -1356,6 +3109,16 @@ static void copymode(const char *args[])
 	}
 	free(cwd);
 
+	/* the application's output is left alone while the editor is running */
+	pty_unwatch(sel->app);
+	sel->throttled = false;
+	if (!pty_watch(sel->editor)) {
+		pty_watch(sel->app);
+		vt_destroy(sel->editor);
+		sel->editor = NULL;
+		return;
+	}
+	vt_data_set(sel->editor, sel);
 	sel->term = sel->editor;
 
 	if (sel->editor_fds[0] >= 0) {
@@ -1380,8 +3143,10 @@ static void copymode(const char *args[])
 		sel->editor_fds[0] = -1;
 	}
 
-	if (args[1])
+	if (args[1]) {
 		vt_write(sel->editor, args[1], strlen(args[1]));
+		pty_queued(sel->editor);
+	}
 }
 
 static void focusn(const char *args[])
@@ -1545,8 +3310,10 @@ static void killclient(const char *args[])
 
 static void paste(const char *args[])
 {
-	if (sel && copyreg.data)
-		vt_write(sel->term, copyreg.data, copyreg.len);
+	if (sel && copyreg.data) {
+		vt_paste(sel->term, copyreg.data, copyreg.len);
+		pty_queued(sel->term);
+	}
 }
 
 static void quit(const char *args[])
@@ -1555,6 +3322,23 @@ static void quit(const char *args[])
 	exit(EXIT_SUCCESS);
 }
 
+static void ratelimit(const char *args[])
+{
+	double rate = 0;
+
+	/* the application is not read while copymode runs */
+	if (!sel || sel->editor)
+		return;
+	/* arg handling, bytes per second or none */
+	if (args && args[0] && strcmp(args[0], "none") &&
+	    (sscanf(args[0], "%lf", &rate) != 1 || rate < 0))
+		return;
+	sel->rate = rate;
+	sel->allowance = rate * RATE_BURST;
+	sel->allowance_at = timestamp();
+	throttle(sel, false);
+}
+
 static void redraw(const char *args[])
 {
 	for (Client *c = clients; c; c = c->next) {
@@ -1590,8 +3374,10 @@ static void scrollback(const char *args[])
 
 static void send(const char *args[])
 {
-	if (sel && args && args[0])
+	if (sel && args && args[0]) {
 		vt_write(sel->term, args[0], strlen(args[0]));
+		pty_queued(sel->term);
+	}
 }
 
 static void setlayout(const char *args[])
@@ -1807,6 +3593,7 @@ static void handle_cmdfifo(void)
 
 	r = read(cmdfifo.fd, cmdbuf, sizeof(cmdbuf) - 1);
 	if (r <= 0) {
+		event_del(cmdfifo.fd);
 		cmdfifo.fd = -1;
 		return;
 	}
@@ -1916,6 +3703,7 @@ static void handle_mouse(void)
 
 	vt_mouse(msel->term, event.x - msel->x, event.y - msel->y,
 		 event.bstate);
+	pty_queued(msel->term);
 
 	for (i = 0; i < countof(buttons); i++) {
 		if (event.bstate & buttons[i].mask)
@@ -1934,6 +3722,7 @@ static void handle_statusbar(void)
 			strncpy(bar.text, strerror(errno), sizeof(bar.text) - 1);
 			bar.text[sizeof(bar.text) - 1] = '\0';
 		}
+		event_del(bar.fd);
 		bar.fd = -1;
 	} else {
 		bar.text[r] = '\0';
@@ -1975,9 +3764,14 @@ static void handle_editor(Client *c)
 	}
 	c->editor_died = false;
 	c->editor_fds[1] = -1;
+	pty_unwatch(c->editor);
+	pty_watch_out(c->editor, false);
+	c->throttled = false;
 	vt_destroy(c->editor);
 	c->editor = NULL;
 	c->term = c->app;
+	if (!pty_watch(c->app))
+		c->died = true;
 	vt_dirty(c->term);
 	draw_content(c);
 	wnoutrefresh(c->window);
@@ -2111,140 +3905,642 @@ static bool parse_args(int argc, char *argv[])
 	return init;
 }
 
-int main(int argc, char *argv[])
+/* the echo of input to the selected client is read, drawn and flushed right
+ * away instead of waiting for its turn with the other clients */
+static void handle_echo(void)
 {
-	KeyCombo keys;
-	unsigned int key_index = 0;
-	memset(keys, 0, sizeof(keys));
+	Client *c = sel;
 
-	setenv("DVTM", VERSION, 1);
-	if (!parse_args(argc, argv)) {
-		setup();
-		startup(NULL);
+	if (!is_content_visible(c) || c->throttled || screen.need_arrange || screen.need_resize)
+		return;
+#if defined(__linux__) && CONFIG_IO_URING
+	if (ring.fd >= 0) {
+		/* reading the pty directly could overtake a completed read */
+		struct pollfd pfd = { .fd = ring.fd, .events = POLLIN };
+		ring_submit();
+		if (poll(&pfd, 1, ECHO_DELAY * 1000) <= 0)
+			return;
+		ring_harvest();
+	} else
+#endif
+	{
+		if (!pty_wait(c->term, ECHO_DELAY))
+			return;
+		ssize_t len = pty_process(c->term, READ_QUANTUM);
+		if (len < 0) {
+			if (errno == EIO)
+				pty_hangup(c->term);
+			return;
+		}
+		rate_charge(c, len);
 	}
 
-	while (running) {
-		int r, nfds = 0;
-		fd_set rd;
+	draw_content(c);
+	curs_set(vt_cursor_visible(c->term));
+	wnoutrefresh(c->window);
+	/* if the terminal is still busy the echo goes out with the next frame,
+	 * which is kept small */
+	output.urgent = true;
+	output.next_frame = 0;
+	output_frame();
+}
+
+/* RAW_INPUT: the bytes read from the terminal are matched against the key
+ * bindings, converted to bytes by raw_setup(), and otherwise forwarded as is */
+static void raw_setup(void)
+{
+	rawinput.start[(unsigned char)'\e'] = true; /* bracketed paste */
+	for (unsigned int b = 0; b < countof(bindings); b++) {
+		RawBinding *r = &rawbindings[b];
+		for (unsigned int k = 0; k < MAX_KEYS && bindings[b].keys[k]; k++) {
+			unsigned int key = bindings[b].keys[k];
+			char byte = key, *bound = NULL;
+			const char *seq = &byte;
+			size_t len = 1;
+			if (key > UCHAR_MAX) {
+#ifdef NCURSES_VERSION
+				bound = keybound(key, 0);
+#endif
+				if (!bound || !*bound || (len = strlen(bound)) > sizeof(r->seq) - r->len) {
+					free(bound);
+					r->len = 0;
+					break;
+				}
+				seq = bound;
+			} else if (len > sizeof(r->seq) - r->len) {
+				r->len = 0;
+				break;
+			}
+			memcpy(r->seq + r->len, seq, len);
+			r->len += len;
+			if (!k)
+				r->first = len;
+			free(bound);
+		}
+		if (r->len)
+			rawinput.start[(unsigned char)r->seq[0]] = true;
+	}
+}
+
+/* The kitty keyboard protocol sends the keys which are otherwise ambiguous,
+ * like escape or those combined with alt, as CSI code[:alternates][;mods] u.
+ * Stores the legacy encoding of such a key, seq starts after the escape,
+ * and returns its length, 0 if seq is something else. */
+static size_t csiu_decode(const char *seq, size_t len, char out[8])
+{
+	unsigned long code = 0, mods = 0;
+	size_t i = 1, n = 0;
+
+	if (len < 3 || seq[0] != '[' || seq[len - 1] != 'u' || !isdigit((unsigned char)seq[1]))
+		return 0;
+	for (; isdigit((unsigned char)seq[i]); i++)
+		code = code * 10 + seq[i] - '0';
+	while (seq[i] == ':' || isdigit((unsigned char)seq[i]))
+		i++;
+	if (seq[i] == ';') {
+		while (isdigit((unsigned char)seq[++i]))
+			mods = mods * 10 + seq[i] - '0';
+		while (seq[i] == ':' || isdigit((unsigned char)seq[i]))
+			i++;
+	}
+	if (i != len - 1 || code > 0x10FFFF)
+		return 0;
+	/* the functional keys are in the private use area, of those only
+	 * the ones of the keypad from KP_0 to KP_SEPARATOR map to a byte */
+	if (code >= 0xE000 && code <= 0xF8FF) {
+		const char *keypad = "0123456789./*-+\r=,";
+		if (code < 57399 || code >= 57399 + strlen(keypad))
+			return 0;
+		code = keypad[code - 57399];
+	}
+
+	mods = mods ? mods - 1 : 0;
+	if ((mods & 1) && code >= 'a' && code <= 'z')
+		code -= 'a' - 'A';
+	if (mods & 4) {
+		if (code >= 'a' && code <= 'z')
+			code -= 'a' - 1;
+		else if (code >= '@' && code <= '_')
+			code -= '@';
+		else if (code == ' ')
+			code = 0;
+		else if (code == '?')
+			code = 127;
+	}
+	if (mods & 2)
+		out[n++] = '\e';
+	if (code < 0x80) {
+		out[n++] = code;
+	} else if (code < 0x800) {
+		out[n++] = 0xc0 | (code >> 6);
+		out[n++] = 0x80 | (code & 0x3f);
+	} else if (code < 0x10000) {
+		out[n++] = 0xe0 | (code >> 12);
+		out[n++] = 0x80 | ((code >> 6) & 0x3f);
+		out[n++] = 0x80 | (code & 0x3f);
+	} else {
+		out[n++] = 0xf0 | (code >> 18);
+		out[n++] = 0x80 | ((code >> 12) & 0x3f);
+		out[n++] = 0x80 | ((code >> 6) & 0x3f);
+		out[n++] = 0x80 | (code & 0x3f);
+	}
+	return n;
+}
+
+/* the echo of what the raw input mode forwarded is awaited afterwards */
+static void input_forward(const char *buf, size_t len)
+{
+	if (len)
+		rawinput.typed = true;
+	input_write(buf, len);
+}
+
+/* length of the first key of a binding at the start of the held bytes */
+static unsigned int raw_held_key(void)
+{
+	for (unsigned int b = 0; b < countof(bindings); b++) {
+		RawBinding *r = &rawbindings[b];
+		if (r->len > r->first && r->first < rawinput.len && !memcmp(r->seq, rawinput.held, r->first))
+			return r->first;
+	}
+	return 0;
+}
+
+/* the held bytes turned out not to be a binding. Like with curses input a
+ * prefix key which is followed by an unbound key is dropped. */
+static void raw_release(void)
+{
+	unsigned int key = raw_held_key();
+	input_forward(rawinput.held + key, rawinput.len - key);
+	rawinput.len = 0;
+}
+
+/* whether the held bytes are the start of a CSI sequence */
+static bool raw_csi_pending(void)
+{
+	if (rawinput.len < 2 || rawinput.held[0] != '\e' || rawinput.held[1] != '[')
+		return false;
+	for (unsigned int i = 2; i < rawinput.len; i++) {
+		char c = rawinput.held[i];
+		if (!isdigit((unsigned char)c) && c != ';' && c != ':')
+			return false;
+	}
+	return rawinput.len < sizeof(rawinput.held);
+}
+
+static void raw_add(char byte)
+{
+	bool prefix = false;
+	KeyBinding *binding = NULL;
+	char key[8];
+	size_t len;
+
+	rawinput.held[rawinput.len++] = byte;
+	if (keyboard.csiu && raw_csi_pending())
+		return;
+	if (keyboard.csiu && rawinput.held[0] == '\e' &&
+	    (len = csiu_decode(rawinput.held + 1, rawinput.len - 1, key))) {
+		rawinput.len = 0;
+		/* only control characters can be bindings */
+		if (len == 1 && key[0] != '\e')
+			raw_add(key[0]);
+		else
+			input_forward(key, len);
+		return;
+	}
+	for (unsigned int b = 0; b < countof(bindings); b++) {
+		RawBinding *r = &rawbindings[b];
+		if (r->len < rawinput.len || memcmp(r->seq, rawinput.held, rawinput.len))
+			continue;
+		if (r->len == rawinput.len)
+			binding = &bindings[b];
+		else
+			prefix = true;
+	}
+
+	if (binding) {
+		rawinput.len = 0;
+		binding->action.cmd(binding->action.args);
+	} else if (rawinput.len == 6 && !memcmp(rawinput.held, "\e[200~", 6)) {
+		rawinput.len = 0;
+		pasting = true;
+		pasted.len = 0;
+	} else if (!prefix && (rawinput.len > 6 || memcmp(rawinput.held, "\e[200~", rawinput.len))) {
+		raw_release();
+	} else if (rawinput.len == sizeof(rawinput.held)) {
+		raw_release();
+	}
+}
+
+static void handle_raw_input(void)
+{
+	char buf[BUFSIZ];
+	ssize_t len = 0;
 
-		if (screen.need_resize)
-			resize_screen();
+	len = typeahead_take(buf, sizeof(buf));
+	if (!len && (len = read(STDIN_FILENO, buf, sizeof(buf))) <= 0) {
+		if (!len)
+			event_drained(STDIN_FILENO);
+		return;
+	}
+
+	size_t plain = 0; /* start of the bytes which are forwarded as they are */
+	for (size_t i = 0; i < (size_t)len; i++) {
+		if (pasting) {
+			paste_add(buf[i]);
+			plain = i + 1;
+			continue;
+		}
+		if (!rawinput.len) {
+			if (!rawinput.start[(unsigned char)buf[i]])
+				continue;
+			input_forward(buf + plain, i - plain);
+			rawinput.since = timestamp();
+		}
+		plain = i + 1;
+		raw_add(buf[i]);
+	}
+	input_forward(buf + plain, len - plain);
 
-		FD_ZERO(&rd);
-		FD_SET(STDIN_FILENO, &rd);
+	if (rawinput.typed) {
+		rawinput.typed = false;
+		handle_echo();
+	}
+	/* a lone escape can only be told apart by the lack of what follows */
+	if (rawinput.len && !raw_held_key())
+		wakeup_at(rawinput.since + keyboard.delay);
+}
+
+/* forwards held bytes which did not turn into a binding in time */
+static void raw_expire(void)
+{
+	if (rawinput.len && !raw_held_key() && timestamp() >= rawinput.since + keyboard.delay)
+		raw_release();
+}
 
-		FD_SET(sigwinch_pipe[PIPE_READ], &rd);
-		nfds = MAX(nfds, sigwinch_pipe[PIPE_READ]);
+/* the outer terminal sends the cursor keys in the form the application expects */
+static void raw_modes(void)
+{
+	int mode = sel && vt_curskeymode_get(sel->term);
+	if (mode == rawinput.curskeymode)
+		return;
+	fputs(mode ? "\033[?1h" : "\033[?1l", stdout);
+	fflush(stdout);
+	rawinput.curskeymode = mode;
+}
 
-		FD_SET(sigchld_pipe[PIPE_READ], &rd);
-		nfds = MAX(nfds, sigchld_pipe[PIPE_READ]);
+/* looks at what follows an escape without waiting for it. A key sent as
+ * CSI u is decoded, a lone escape of a terminal without CSI u is held back
+ * until either more input arrives or keyboard.delay passed. Returns ERR if
+ * there is nothing left to do, otherwise '\e' with plain set unless the
+ * bytes following it were pushed back for keypress(). */
+static int escape_read(bool *plain)
+{
+	char seq[16], key[8];
+	size_t len = 0, n;
+
+	*plain = false;
+	nodelay(stdscr, TRUE);
+	for (int t; len < sizeof(seq) && (t = getch()) != ERR;) {
+		if (t > UCHAR_MAX) {
+			ungetch(t);
+			break;
+		}
+		seq[len++] = t;
+		/* a single character or a whole CSI sequence */
+		if (seq[0] != '[' || (len > 1 && t >= 0x40 && t <= 0x7e))
+			break;
+	}
 
-		if (cmdfifo.fd >= 0) {
-			FD_SET(cmdfifo.fd, &rd);
-			nfds = MAX(nfds, cmdfifo.fd);
+	if (!len) {
+		if (keyboard.csiu) {
+			*plain = true;
+			return '\e';
 		}
+		keyboard.escape = true;
+		keyboard.escape_at = timestamp();
+		wakeup_at(keyboard.escape_at + keyboard.delay);
+		return ERR;
+	}
 
-		if (bar.fd >= 0) {
-			FD_SET(bar.fd, &rd);
-			nfds = MAX(nfds, bar.fd);
+	if (keyboard.csiu && (n = csiu_decode(seq, len, key))) {
+		if (n == 1 && key[0] == '\e') {
+			*plain = true;
+			return '\e';
 		}
+		/* control characters go through the key bindings again */
+		if (n == 1)
+			ungetch((unsigned char)key[0]);
+		else
+			input_write(key, n);
+		return ERR;
+	}
+
+	while (len > 0)
+		ungetch((unsigned char)seq[--len]);
+	return '\e';
+}
+
+/* delivers an escape whose wait for more input is over */
+static void escape_expire(void)
+{
+	if (keyboard.escape && timestamp() >= keyboard.escape_at + keyboard.delay) {
+		int key = '\e';
+		keyboard.escape = false;
+		type(&key, 1);
+	}
+}
 
-		for (Client *c = clients; c;) {
-			if (c->editor && c->editor_died)
-				handle_editor(c);
-			if (!c->editor && c->died) {
-				Client *t = c->next;
-				destroy(c);
-				c = t;
+/* handles all the input which is available, key bindings and everything
+ * else which could change where the keys go are dealt with in order */
+static void handle_input(void)
+{
+	int typed[256];
+	unsigned int ntyped = 0;
+	bool echo = false, any = false;
+
+	for (;;) {
+		if (pasting) {
+			paste_collect();
+			if (pasting)
+				break;
+		}
+		nodelay(stdscr, TRUE);
+		int code = getch();
+		if (code == ERR) {
+			/* ncurses takes back at most 137 characters at once */
+			char buf[128];
+			size_t n = typeahead_take(buf, sizeof(buf));
+			if (n) {
+				while (n > 0)
+					ungetch((unsigned char)buf[--n]);
 				continue;
 			}
-			int pty = c->editor ? vt_pty_get(c->editor)
-					    : vt_pty_get(c->app);
-			FD_SET(pty, &rd);
-			nfds = MAX(nfds, pty);
-			c = c->next;
+			if (!any)
+				event_drained(STDIN_FILENO);
+			break;
 		}
-
-		doupdate();
-		r = select(nfds + 1, &rd, NULL, NULL, NULL);
-
-		if (r < 0) {
-			if (errno == EINTR)
+		any = true;
+		if (keyboard.escape) {
+			/* what follows the held escape makes it a sequence */
+			keyboard.escape = false;
+			type(typed, ntyped);
+			ntyped = 0;
+			echo = true;
+			if (code <= UCHAR_MAX) {
+				ungetch(code);
+				keypress('\e');
 				continue;
-			perror("select()");
-			exit(EXIT_FAILURE);
+			}
+			int key = '\e';
+			type(&key, 1);
 		}
-
-		if (FD_ISSET(STDIN_FILENO, &rd)) {
-			int code = getch();
-			if (code >= 0) {
-				keys[key_index++] = code;
-				KeyBinding *binding = NULL;
-				if (code == KEY_MOUSE) {
-					key_index = 0;
-					handle_mouse();
-				} else if ((binding = keybinding(keys, key_index))) {
-					unsigned int key_length = MAX_KEYS;
-					while (key_length > 1
-					    && !binding->keys[key_length - 1])
-						key_length--;
-					if (key_index == key_length) {
-						binding->action.cmd(
-							binding->action.args);
-						key_index = 0;
-						memset(keys, 0, sizeof(keys));
-					}
-				} else {
-					key_index = 0;
-					memset(keys, 0, sizeof(keys));
-					keypress(code);
+		keys[key_index++] = code;
+		KeyBinding *binding = NULL;
+		if (code == KEY_MOUSE) {
+			type(typed, ntyped);
+			ntyped = 0;
+			key_index = 0;
+			handle_mouse();
+		} else if ((binding = keybinding(keys, key_index))) {
+			type(typed, ntyped);
+			ntyped = 0;
+			unsigned int key_length = MAX_KEYS;
+			while (key_length > 1 && !binding->keys[key_length - 1])
+				key_length--;
+			if (key_index == key_length) {
+				nodelay(stdscr, FALSE);
+				binding->action.cmd(binding->action.args);
+				key_index = 0;
+				memset(keys, 0, sizeof(keys));
+			}
+		} else {
+			key_index = 0;
+			memset(keys, 0, sizeof(keys));
+			echo = true;
+			bool plain = false;
+			if (code == '\e') {
+				type(typed, ntyped);
+				ntyped = 0;
+				if (escape_read(&plain) == ERR)
+					continue;
+			}
+			if (code == '\e' && !plain) {
+				keypress(code);
+			} else {
+				if (ntyped == countof(typed)) {
+					type(typed, ntyped);
+					ntyped = 0;
 				}
+				typed[ntyped++] = code;
 			}
-			if (r == 1) /* no data available on pty's */
+		}
+	}
+	nodelay(stdscr, FALSE);
+
+	type(typed, ntyped);
+	if (echo)
+		handle_echo();
+}
+
+static void parse_job(ParseJob *job)
+{
+	job->len = pty_process(job->term, job->max);
+	job->err = errno;
+}
+
+/* reads from the ready ptys in turns of at most READ_QUANTUM bytes each,
+ * a pty leaves the rotation once it is drained or its client exceeded its
+ * rate. Only whole rounds are done, until READ_BUDGET bytes or
+ * READ_BUDGET_TIME seconds are used up or input arrives. Whatever is left
+ * is read in the next iteration of the main loop. */
+static void handle_ptys(Vt *ready[], int n)
+{
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	double deadline = timestamp() + READ_BUDGET_TIME;
+	size_t total = 0;
+	ParseJob jobs[MAX(n, 1)];
+
+	while (n > 0 && total < READ_BUDGET && timestamp() < deadline) {
+		if (total && poll(&pfd, 1, 0) > 0)
+			break;
+		for (int i = 0; i < n; i++) {
+			Client *c = vt_data_get(ready[i]);
+			jobs[i].term = ready[i];
+			jobs[i].max = READ_QUANTUM;
+			rate_refill(c, timestamp());
+			if (c->rate)
+				jobs[i].max = MIN(jobs[i].max, (size_t)MAX(c->allowance, 1));
+		}
+		parse_round(jobs, n, parse_job);
+		int active = 0;
+		for (int i = 0; i < n; i++) {
+			Client *c = vt_data_get(jobs[i].term);
+			ssize_t len = jobs[i].len;
+			if (len < 0) {
+				if (jobs[i].err == EIO)
+					pty_hangup(jobs[i].term);
 				continue;
+			}
+			total += len;
+			if (rate_charge(c, len) && (size_t)len == jobs[i].max)
+				ready[active++] = jobs[i].term;
+		}
+		n = active;
+	}
+}
+
+/* clients which exceeded their rate are throttled until enough allowance
+ * accumulated again */
+static void throttle_update(Client *c, double now)
+{
+	double resume = c->rate * RATE_BURST / 2;
+	if (c->rate && c->allowance <= 0)
+		throttle(c, true);
+	rate_refill(c, now);
+	if (!c->throttled)
+		return;
+	if (!c->rate || c->allowance >= resume) {
+		throttle(c, false);
+	} else {
+		wakeup_at(now + (resume - c->allowance) / c->rate);
+	}
+}
+
+/* destroys the noticed clients whose application died, once their editor
+ * is gone as well */
+static void handle_died(void)
+{
+	for (Client **tc = &noticed; *tc;) {
+		Client *c = *tc;
+		if (c->editor && c->editor_died)
+			handle_editor(c);
+		if (!c->editor && c->died) {
+			/* takes c off the list */
+			destroy(c);
+			continue;
 		}
+		tc = &c->nnext;
+	}
+}
 
-		if (FD_ISSET(sigwinch_pipe[PIPE_READ], &rd)) {
-			char buf[256];
-			while (read(sigwinch_pipe[PIPE_READ], &buf, sizeof(buf)) > 0)
-				;
-			handle_sigwinch();
+/* looks at the clients noticed since the last time, those which are not
+ * done yet stay on the list */
+static void handle_noticed(void)
+{
+	double now = timestamp();
+	Client *list = noticed, *keep = NULL;
+
+	noticed = NULL;
+	while (list) {
+		Client *c = list;
+		list = c->nnext;
+		handle_term(c);
+		throttle_update(c, now);
+		/* replies of the terminal to the application */
+		pty_queued(c->term);
+		if (c->died || c->editor_died || c->throttled || c->title_changed || c->bell) {
+			c->nnext = keep;
+			keep = c;
+		} else {
+			c->noticed = false;
 		}
-		if (FD_ISSET(sigchld_pipe[PIPE_READ], &rd)) {
-			char buf[256];
-			while (read(sigchld_pipe[PIPE_READ], &buf, sizeof(buf)) > 0)
-				;
-			handle_sigchld();
+		/* noticed meanwhile */
+		if (!list) {
+			list = noticed;
+			noticed = NULL;
 		}
+	}
+	noticed = keep;
+}
 
-		if (cmdfifo.fd >= 0 && FD_ISSET(cmdfifo.fd, &rd))
-			handle_cmdfifo();
+/* returns false for the ptys, which are scheduled by handle_ptys() */
+static bool handle_event(void *data)
+{
+	if (data == event_source(EV_STDIN) && RAW_INPUT)
+		handle_raw_input();
+	else if (data == event_source(EV_STDIN))
+		handle_input();
+	else if (data == event_source(EV_SIGNAL))
+		handle_signals();
+	else if (data == event_source(EV_OUTPUT))
+		handle_output_idle();
+	else if (data == event_source(EV_CMDFIFO))
+		handle_cmdfifo();
+	else if (data == event_source(EV_STATUSBAR))
+		handle_statusbar();
+#if defined(__linux__) && CONFIG_IO_URING
+	else if (data == event_source(EV_RING))
+		ring_drain();
+#endif
+	else if (data == event_source(EV_READER))
+		readers_clear();
+	else if (data == event_source(EV_WRITABLE))
+		handle_writes();
+	else
+		return false;
+	return true;
+}
 
-		if (bar.fd >= 0 && FD_ISSET(bar.fd, &rd))
-			handle_statusbar();
+int main(int argc, char *argv[])
+{
+	setenv("DVTM", VERSION, 1);
+	if (!parse_args(argc, argv)) {
+		setup();
+		startup(NULL);
+	}
+	/* what was typed meanwhile goes to the windows just created */
+	if (keyboard.typeahead_len)
+		handle_event(event_source(EV_STDIN));
 
-		for (Client *c = clients; c; c = c->next) {
-			if (FD_ISSET(vt_pty_get(c->term), &rd)) {
-				if (vt_process(c->term) < 0 && errno == EIO) {
-					if (c->editor)
-						c->editor_died = true;
-					else
-						c->died = true;
-					continue;
-				}
-			}
+	while (running) {
+		void *ready[64];
+		Vt *busy[countof(ready)];
+		int n, nbusy = 0;
 
-			if (c != sel && is_content_visible(c)) {
-				draw_content(c);
-				wnoutrefresh(c->window);
-			}
+		if (screen.need_resize) {
+			if (timestamp() >= screen.resize_at)
+				resize_screen();
+			else
+				wakeup_at(screen.resize_at);
+		}
+
+		handle_died();
+		if (screen.need_arrange)
+			arrange_apply();
+		if (RAW_INPUT)
+			raw_modes();
+		output_frame();
+		n = event_wait(ready, countof(ready), wakeup ? MAX(wakeup - timestamp(), 0) : -1);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("event_wait()");
+			exit(EXIT_FAILURE);
 		}
 
-		if (is_content_visible(sel)) {
-			draw_content(sel);
-			curs_set(vt_cursor_visible(sel->term));
-			wnoutrefresh(sel->window);
+		wakeup = 0;
+		if (RAW_INPUT)
+			raw_expire();
+		else
+			escape_expire();
+
+		for (int i = 0; i < n; i++) {
+			if (!handle_event(ready[i]))
+				busy[nbusy++] = ready[i];
 		}
+		nbusy = pty_buffered(busy, nbusy, countof(busy));
+		handle_ptys(busy, nbusy);
+		handle_noticed();
+		/* the readers do not notify about what is left over */
+		if (pty_buffered(busy, 0, 1))
+			wakeup_at(timestamp());
+
+		if (n == 1 && ready[0] == event_source(EV_STDIN))
+			continue; /* no data available on pty's */
+
+		draw_changes();
 	}
 
 	return 0;
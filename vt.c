@@ -21,6 +21,7 @@
 #include <fcntl.h>
 #include <langinfo.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -30,6 +31,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #if defined(__linux__) || defined(__CYGWIN__)
@@ -66,22 +68,56 @@
 # endif
 # if !NCURSES_EXT_COLORS
 #  define MAX_COLOR_PAIRS MIN(COLOR_PAIRS, 256)
+# elif NCURSES_EXT_COLORS >= 20170401
+#  define HAVE_EXTENDED_COLORS 1
 # endif
 #endif
 #ifndef MAX_COLOR_PAIRS
 # define MAX_COLOR_PAIRS COLOR_PAIRS
 #endif
 
-static bool is_utf8, has_default_colors;
-static short int color_pairs_reserved, color_pairs_max, color_pair_current;
-static short int *color2palette, default_fg, default_bg;
+/* how long to wait for the end of a synchronized update before drawing anyway */
+#define SYNC_TIMEOUT 0.15
+
+/* the read buffer grows up to this size while reads keep filling it */
+#define RBUF_MAX (64 * 1024)
+
+/* cell colors are either -1 (default), a palette index or a 24-bit RGB value tagged with COLOR_RGB */
+#define COLOR_RGB (1 << 24)
+#define IS_COLOR_RGB(c) ((c) != -1 && ((c) & COLOR_RGB))
+
+typedef struct {
+	int fg, bg;		/* colors the pair was initialized with */
+	unsigned int frame;	/* frame in which the pair was last used, 0 if never */
+	unsigned int refs;	/* how often it is used by the rows shown in windows */
+} ColorPair;
+
+typedef struct {
+	int fg, bg;
+	short int pair;		/* 0 if the slot is unused, negative for reserved pairs */
+} ColorMapping;
+
+typedef struct {
+	int rgb;		/* tagged with COLOR_RGB, 0 if the slot is unused */
+	short int color;	/* nearest palette entry */
+} ColorQuantized;
+
+static bool is_utf8, has_default_colors, has_direct_colors, strict_compare, render_concurrent;
+static short int color_pairs_reserved, color_pairs_max, color_pairs_top, color_pair_current;
+static short int default_fg, default_bg;
+static ColorMapping *color2palette;	/* open addressing hash table, (fg, bg) -> pair */
+static unsigned int color2palette_mask, color2palette_count;
+static ColorQuantized color_quantized[1024];
+static ColorPair *color_pairs;
+static unsigned int color_frame = 2;
+static unsigned long color_hits, color_misses, color_evictions;
 static char vt_term[32];
 
 typedef struct {
 	wchar_t wc;
 	attr_t attr;
-	short int fg;
-	short int bg;
+	int fg;
+	int bg;
 } Cell;
 
 typedef struct {
@@ -152,10 +188,25 @@ typedef struct {
 	int curs_col;		/* current cursor column (zero based) */
 	int curs_srow;		/* saved cursor row (zero based) */
 	int curs_scol;		/* saved cursor col (zero based) */
-	short int curfg, curbg;	/* current fore and background colors */
-	short int savfg, savbg;	/* saved colors */
+	int curfg, curbg;	/* current fore and background colors */
+	int savfg, savbg;	/* saved colors */
 } Buffer;
 
+/* data which could not yet be written to the pty */
+typedef struct Pending Pending;
+struct Pending {
+	VtChunk *chunk;
+	size_t off;			/* how much of it was already written */
+	Pending *next;
+};
+
+struct VtChunk {
+	unsigned int refs;		/* one for every queue it is in */
+	VtChunk *bracketed;		/* the data as a bracketed paste, see vt_paste_chunk() */
+	size_t len;
+	char data[];
+};
+
 struct Vt {
 	Buffer buffer_normal;		/* normal screen buffer */
 	Buffer buffer_alternate;	/* alternate screen buffer */
@@ -173,15 +224,25 @@ struct Vt {
 	bool bell:1;
 	bool relposmode:1;
 	bool mousetrack:1;
+	bool bracketed_paste:1;
+	bool sync:1;
 	bool graphmode:1;
 	bool savgraphmode:1;
 	bool charsets[2];
 	/* buffers and parsing state */
-	char rbuf[BUFSIZ];
+	char *rbuf;
 	char ebuf[BUFSIZ];
-	unsigned int rlen, elen;
+	Pending *pending, **pending_tail;	/* output queued for the pty */
+	unsigned int rlen, rsize, elen;
 	int srow, scol;			/* last known offset to display start row, start column */
+	double sync_start;		/* when the application started a synchronized update */
 	char title[256];		/* xterm style window title */
+	uint32_t *drawn;		/* hash of the cells last drawn on each window row, 0 if unknown */
+	Cell *shadow;			/* copy of the cells last drawn on each window row, only
+					 * used for strict comparisons or concurrent rendering */
+	bool *stale;			/* rows whose shadow was not yet copied to the window */
+	short int *pairs;		/* color pairs used on each window row, 0 terminated */
+	int drawn_rows, drawn_cols;	/* dimension of the above */
 	vt_title_handler_t title_handler;	/* hook which is called when title changes */
 	vt_urgent_handler_t urgent_handler;	/* hook which is called upon bell */
 	void *data;			/* user supplied data */
@@ -244,6 +305,15 @@ static const char *keytable[KEY_MAX + 1] = {
 static void puttab(Vt *t, int count);
 static void process_nonprinting(Vt *t, wchar_t wc);
 static void send_curs(Vt *t);
+static void send_mode(Vt *t, int mode);
+static void pending_clear(Vt *t);
+
+static double timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 __attribute__((const))
 static attr_t build_attrs(attr_t curattrs)
@@ -616,8 +686,42 @@ static bool is_valid_csi_ender(int c)
 	    || (c == '@' || c == '`');
 }
 
+/* parses the extended color of SGR 38/48 at param[*i] in either of the
+ * forms 5;n, 2;r;g;b or the colon separated 5:n, 2:r:g:b and 2::r:g:b */
+static int sgr_color(int param[], unsigned int pcount, unsigned int subparams,
+                     unsigned int *i, int color)
+{
+	unsigned int j = *i + 1, n;
+
+	if (subparams & (1u << j)) {
+		for (n = 0; j + n < pcount && (subparams & (1u << (j + n))); n++);
+		*i += n;
+		if (param[j] == 2 && n >= 5)
+			j++; /* skip color space identifier */
+		else if (!((param[j] == 2 && n == 4) || (param[j] == 5 && n >= 2)))
+			return color;
+	} else if (j < pcount && param[j] == 5 && j + 1 < pcount) {
+		*i += 2;
+	} else if (j < pcount && param[j] == 2 && j + 3 < pcount) {
+		*i += 4;
+	} else if (j < pcount && (param[j] == 2 || param[j] == 5)) {
+		*i = pcount; /* truncated, do not misinterpret the rest */
+		return color;
+	} else {
+		return color;
+	}
+
+	if (param[j] == 5)
+		return param[j + 1] >= 0 && param[j + 1] <= 255 ? param[j + 1] : color;
+	for (n = 1; n <= 3; n++) {
+		if (param[j + n] < 0 || param[j + n] > 255)
+			return color;
+	}
+	return COLOR_RGB | param[j + 1] << 16 | param[j + 2] << 8 | param[j + 3];
+}
+
 /* interprets a 'set attribute' (SGR) CSI escape sequence */
-static void interpret_csi_sgr(Vt *t, int param[], unsigned int pcount)
+static void interpret_csi_sgr(Vt *t, int param[], unsigned int pcount, unsigned int subparams)
 {
 	Buffer *b = t->buffer;
 	if (pcount == 0) {
@@ -680,10 +784,7 @@ static void interpret_csi_sgr(Vt *t, int param[], unsigned int pcount)
 			b->curfg = param[i] - 30;
 			break;
 		case 38:
-			if ((i + 2) < pcount && param[i + 1] == 5) {
-				b->curfg = param[i + 2];
-				i += 2;
-			}
+			b->curfg = sgr_color(param, pcount, subparams, &i, b->curfg);
 			break;
 		case 39:
 			b->curfg = -1;
@@ -692,10 +793,7 @@ static void interpret_csi_sgr(Vt *t, int param[], unsigned int pcount)
 			b->curbg = param[i] - 40;
 			break;
 		case 48:
-			if ((i + 2) < pcount && param[i + 1] == 5) {
-				b->curbg = param[i + 2];
-				i += 2;
-			}
+			b->curbg = sgr_color(param, pcount, subparams, &i, b->curbg);
 			break;
 		case 49:
 			b->curbg = -1;
@@ -978,6 +1076,14 @@ static void interpret_csi_priv_mode(Vt *t, int param[], unsigned int pcount, boo
 		case 1000: /* enable/disable normal mouse tracking */
 			t->mousetrack = set;
 			break;
+		case 2004: /* enable/disable bracketed paste */
+			t->bracketed_paste = set;
+			break;
+		case 2026: /* begin/end synchronized update */
+			if (set && !t->sync)
+				t->sync_start = timestamp();
+			t->sync = set;
+			break;
 		}
 	}
 }
@@ -986,7 +1092,7 @@ static void interpret_csi(Vt *t)
 {
 	Buffer *b = t->buffer;
 	int csiparam[16];
-	unsigned int param_count = 0;
+	unsigned int param_count = 0, subparams = 0;
 	const char *p = t->ebuf + 1;
 	char verb = t->ebuf[t->elen - 1];
 
@@ -994,9 +1100,11 @@ static void interpret_csi(Vt *t)
 	for (p += (t->ebuf[1] == '?'); *p; p++) {
 		if (IS_CONTROL(*p)) {
 			process_nonprinting(t, *p);
-		} else if (*p == ';') {
+		} else if (*p == ';' || *p == ':') {
 			if (param_count >= countof(csiparam))
 				return; /* too long! */
+			if (*p == ':')
+				subparams |= 1u << param_count;
 			csiparam[param_count++] = 0;
 		} else if (isdigit((unsigned char)*p)) {
 			if (param_count == 0)
@@ -1012,6 +1120,10 @@ static void interpret_csi(Vt *t)
 		case 'l': /* private set/reset mode */
 			interpret_csi_priv_mode(t, csiparam, param_count, verb == 'h');
 			break;
+		case 'p': /* DECRQM: request private mode */
+			if (param_count == 1 && t->ebuf[t->elen - 2] == '$')
+				send_mode(t, csiparam[0]);
+			break;
 		}
 		return;
 	}
@@ -1023,7 +1135,7 @@ static void interpret_csi(Vt *t)
 		interpret_csi_mode(t, csiparam, param_count, verb == 'h');
 		break;
 	case 'm': /* set attribute */
-		interpret_csi_sgr(t, csiparam, param_count);
+		interpret_csi_sgr(t, csiparam, param_count, subparams);
 		break;
 	case 'J': /* erase display */
 		interpret_csi_ed(t, csiparam, param_count);
@@ -1394,23 +1506,13 @@ static void put_wc(Vt *t, wchar_t wc)
 	}
 }
 
-int vt_process(Vt *t)
+/* interprets the read buffer, an incomplete trailing character is kept */
+static void process_rbuf(Vt *t)
 {
-	int res;
 	unsigned int pos = 0;
 	mbstate_t ps;
 	memset(&ps, 0, sizeof(ps));
 
-	if (t->pty < 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	res = read(t->pty, t->rbuf + t->rlen, sizeof(t->rbuf) - t->rlen);
-	if (res < 0)
-		return -1;
-
-	t->rlen += res;
 	while (pos < t->rlen) {
 		wchar_t wc;
 		ssize_t len;
@@ -1419,7 +1521,7 @@ int vt_process(Vt *t)
 		if (len == -2) {
 			t->rlen -= pos;
  			memmove(t->rbuf, t->rbuf + pos, t->rlen);
-			return 0;
+			return;
 		}
 
 		if (len == -1) {
@@ -1433,7 +1535,69 @@ int vt_process(Vt *t)
 
 	t->rlen -= pos;
 	memmove(t->rbuf, t->rbuf + pos, t->rlen);
-	return 0;
+}
+
+/* reads at most max bytes from the pty, stopping early once it would block.
+ * Returns the number of bytes processed. */
+ssize_t vt_process(Vt *t, size_t max)
+{
+	struct pollfd pfd = { .fd = t->pty, .events = POLLIN };
+	size_t total = 0;
+
+	if (t->pty < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (total < max) {
+		ssize_t res = read(t->pty, t->rbuf + t->rlen, MIN(t->rsize - t->rlen, max - total));
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return total ? (ssize_t)total : -1;
+		}
+		if (res == 0)
+			break;
+
+		bool full = t->rlen + res == t->rsize;
+		t->rlen += res;
+		process_rbuf(t);
+		total += res;
+
+		/* adapt the buffer to how much the application writes at once */
+		if (full && t->rsize < RBUF_MAX) {
+			char *rbuf = realloc(t->rbuf, 2 * t->rsize);
+			if (rbuf) {
+				t->rbuf = rbuf;
+				t->rsize *= 2;
+			}
+		} else if ((size_t)res < t->rsize / 4 && t->rsize > BUFSIZ && t->rlen <= t->rsize / 2) {
+			char *rbuf = realloc(t->rbuf, t->rsize / 2);
+			if (rbuf) {
+				t->rbuf = rbuf;
+				t->rsize /= 2;
+			}
+		}
+
+		if (total < max && (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)))
+			break;
+	}
+
+	return total;
+}
+
+void vt_process_data(Vt *t, const char *buf, size_t len)
+{
+	while (len > 0) {
+		size_t n = MIN(len, t->rsize - t->rlen);
+		memcpy(t->rbuf + t->rlen, buf, n);
+		t->rlen += n;
+		buf += n;
+		len -= n;
+		process_rbuf(t);
+	}
 }
 
 void vt_default_colors_set(Vt *t, attr_t attrs, short int fg, short int bg)
@@ -1443,6 +1607,111 @@ void vt_default_colors_set(Vt *t, attr_t attrs, short int fg, short int bg)
 	t->defbg = bg;
 }
 
+/* the pairs of a row are no longer shown once it is redrawn */
+static void row_pairs_release(short int *pairs, int cols)
+{
+	for (int i = 0; i < cols && pairs[i]; i++) {
+		if (color_pairs)
+			color_pairs[pairs[i]].refs--;
+	}
+}
+
+/* forget what the window shows */
+static void drawn_clear(Vt *t)
+{
+	for (int i = 0; i < t->drawn_rows; i++)
+		row_pairs_release(t->pairs + i * t->drawn_cols, t->drawn_cols);
+	t->drawn_rows = 0;
+}
+
+static bool drawn_resize(Vt *t, int rows, int cols)
+{
+	drawn_clear(t);
+
+	uint32_t *drawn = realloc(t->drawn, sizeof(*drawn) * rows);
+	if (!drawn)
+		return false;
+	t->drawn = drawn;
+	if (strict_compare || render_concurrent) {
+		bool *stale = realloc(t->stale, sizeof(*stale) * rows);
+		if (!stale)
+			return false;
+		t->stale = stale;
+		Cell *shadow = realloc(t->shadow, sizeof(*shadow) * rows * cols);
+		if (!shadow)
+			return false;
+		t->shadow = shadow;
+		memset(t->stale, 0, sizeof(*t->stale) * rows);
+	}
+	short int *pairs = realloc(t->pairs, sizeof(*pairs) * rows * cols);
+	if (!pairs)
+		return false;
+	t->pairs = pairs;
+	t->drawn_rows = rows;
+	t->drawn_cols = cols;
+	memset(t->drawn, 0, sizeof(*t->drawn) * rows);
+	memset(t->pairs, 0, sizeof(*t->pairs) * rows * cols);
+	return true;
+}
+
+/* the cell as it ends up on screen, with the defaults substituted */
+static Cell cell_displayed(Vt *t, const Cell *cell)
+{
+	Cell c = *cell;
+	if (c.attr == A_NORMAL)
+		c.attr = t->defattrs;
+	if (c.fg == -1)
+		c.fg = t->deffg;
+	if (c.bg == -1)
+		c.bg = t->defbg;
+	return c;
+}
+
+static uint32_t row_hash(Vt *t, Row *row, int cols)
+{
+	/* FNV-1a, but mixing in whole words instead of single bytes */
+	uint32_t hash = 2166136261u;
+	for (int j = 0; j < cols; j++) {
+		Cell c = cell_displayed(t, row->cells + j);
+		hash = (hash ^ (uint32_t)c.wc) * 16777619u;
+		hash = (hash ^ (uint32_t)c.attr) * 16777619u;
+		hash = (hash ^ (uint32_t)c.fg) * 16777619u;
+		hash = (hash ^ (uint32_t)c.bg) * 16777619u;
+	}
+	return hash ? hash : 1;
+}
+
+/* check whether window row i already shows the content of row, if not
+ * remember the content as drawn. The caller has to make sure the row
+ * is tracked, see row_tracked(). */
+static bool row_unchanged(Vt *t, Row *row, int i, int cols)
+{
+	uint32_t hash = row_hash(t, row, cols);
+	bool unchanged = t->drawn[i] == hash;
+	Cell *shadow = t->shadow ? t->shadow + i * cols : NULL;
+
+	if (unchanged && shadow && strict_compare) {
+		for (int j = 0; j < cols && unchanged; j++) {
+			Cell c = cell_displayed(t, row->cells + j);
+			unchanged = c.wc == shadow[j].wc && c.attr == shadow[j].attr &&
+				    c.fg == shadow[j].fg && c.bg == shadow[j].bg;
+		}
+	}
+
+	if (!unchanged) {
+		t->drawn[i] = hash;
+		for (int j = 0; shadow && j < cols; j++)
+			shadow[j] = cell_displayed(t, row->cells + j);
+	}
+	return unchanged;
+}
+
+/* whether what window row i shows is known, only fails if memory is short */
+static bool row_tracked(Vt *t, int i)
+{
+	return i < t->drawn_rows && t->buffer->cols == t->drawn_cols;
+}
+
 Vt *vt_create(int rows, int cols, int scroll_size)
 {
 	if (rows <= 0 || cols <= 0)
@@ -1455,9 +1724,17 @@ Vt *vt_create(int rows, int cols, int scroll_size)
 	t->pty = -1;
 	t->deffg = t->defbg = -1;
 	t->buffer = &t->buffer_normal;
-
-	if (!buffer_init(&t->buffer_normal,    rows, cols, scroll_size)
-	 || !buffer_init(&t->buffer_alternate, rows, cols,           0)) {
+	t->rsize = BUFSIZ;
+
+	if (!(t->rbuf = malloc(t->rsize))
+	 || !buffer_init(&t->buffer_normal,    rows, cols, scroll_size)
+	 || !buffer_init(&t->buffer_alternate, rows, cols,           0)
+	 || !drawn_resize(t, rows, cols)) {
+		free(t->drawn);
+		free(t->stale);
+		free(t->shadow);
+		free(t->pairs);
+		free(t->rbuf);
 		free(t);
 		return NULL;
 	}
@@ -1471,11 +1748,18 @@ void vt_resize(Vt *t, int rows, int cols)
 
 	if (rows <= 0 || cols <= 0)
 		return;
+	/* spare the application a pointless SIGWINCH and repaint,
+	 * but its window changed and has to be filled again */
+	if (rows == t->buffer_normal.rows && cols == t->buffer_normal.cols) {
+		vt_dirty(t);
+		return;
+	}
 
 	vt_noscroll(t);
 	buffer_resize(&t->buffer_normal, rows, cols);
 	buffer_resize(&t->buffer_alternate, rows, cols);
 	cursor_clamp(t);
+	drawn_resize(t, rows, cols);
 	ioctl(t->pty, TIOCSWINSZ, &ws);
 	kill(-t->pid, SIGWINCH);
 }
@@ -1486,6 +1770,13 @@ void vt_destroy(Vt *t)
 		return;
 	buffer_free(&t->buffer_normal);
 	buffer_free(&t->buffer_alternate);
+	drawn_clear(t);
+	free(t->drawn);
+	free(t->shadow);
+	free(t->stale);
+	free(t->pairs);
+	free(t->rbuf);
+	pending_clear(t);
 	close(t->pty);
 	free(t);
 }
@@ -1495,12 +1786,30 @@ void vt_dirty(Vt *t)
 	Buffer *b = t->buffer;
 	for (Row *row = b->lines, *end = row + b->rows; row < end; row++)
 		row->dirty = true;
+	if (t->drawn)
+		memset(t->drawn, 0, sizeof(*t->drawn) * t->drawn_rows);
 }
 
-void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
+int vt_sync_timeout(Vt *t)
+{
+	if (!t->sync)
+		return -1;
+	double remaining = t->sync_start + SYNC_TIMEOUT - timestamp();
+	return remaining > 0 ? remaining * 1000 + 1 : -1;
+}
+
+/* Copies the rows which changed since they were last drawn to the shadow,
+ * if there is one. Touches neither curses nor the color pairs and can thus
+ * run concurrently for different terminals, vt_draw() puts the result on
+ * the window. */
+void vt_render(Vt *t, int srow, int scol)
 {
 	Buffer *b = t->buffer;
 
+	/* do not show half finished updates of the application */
+	if (vt_sync_timeout(t) >= 0)
+		return;
+
 	if (srow != t->srow || scol != t->scol) {
 		vt_dirty(t);
 		t->srow = srow;
@@ -1509,52 +1818,90 @@ void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
 
 	for (int i = 0; i < b->rows; i++) {
 		Row *row = b->lines + i;
-
-		if (!row->dirty)
+		/* otherwise rows are drawn straight from the buffer */
+		if (!t->shadow || !row->dirty || !row_tracked(t, i))
 			continue;
+		row->dirty = false;
+		if (!row_unchanged(t, row, i, b->cols))
+			t->stale[i] = true;
+	}
+}
 
-		wmove(win, srow + i, scol);
-		Cell *cell = NULL;
-		for (int j = 0; j < b->cols; j++) {
-			Cell *prev_cell = cell;
-			cell = row->cells + j;
-			if (!prev_cell
-			 || cell->attr != prev_cell->attr
-			 || cell->fg != prev_cell->fg
-			 || cell->bg != prev_cell->bg) {
-				if (cell->attr == A_NORMAL)
-					cell->attr = t->defattrs;
-				if (cell->fg == -1)
-					cell->fg = t->deffg;
-				if (cell->bg == -1)
-					cell->bg = t->defbg;
-				wattrset(win, cell->attr << NCURSES_ATTR_SHIFT);
-				wcolor_set(win,
-					   vt_color_get(t, cell->fg, cell->bg),
-					   NULL);
-			}
+/* pairs, if given, is where the used color pairs are recorded */
+static void draw_row(Vt *t, WINDOW *win, int y, int x, const Cell *cells, int cols,
+		     short int *pairs)
+{
+	Cell prev = { 0 };
+	int npairs = 0;
 
-			if (is_utf8 && cell->wc >= 128) {
-				char buf[MB_CUR_MAX + 1];
-				size_t len = wcrtomb(buf, cell->wc, NULL);
-				if (len > 0) {
-					waddnstr(win, buf, len);
-					if (wcwidth(cell->wc) > 1)
-						j++;
-				}
-			} else {
-				waddch(win,
-				       cell->wc > ' ' ? cell->wc : ' ');
+	if (pairs)
+		row_pairs_release(pairs, cols);
+
+	wmove(win, y, x);
+	for (int j = 0; j < cols; j++) {
+		Cell cell = cell_displayed(t, cells + j);
+		if (!j || cell.attr != prev.attr || cell.fg != prev.fg || cell.bg != prev.bg) {
+			short int pair = vt_color_get(t, cell.fg, cell.bg);
+			wattrset(win, cell.attr << NCURSES_ATTR_SHIFT);
+			wcolor_set(win, pair, NULL);
+			if (pairs && pair) {
+				pairs[npairs++] = pair;
+				color_pairs[pair].refs++;
+			}
+		}
+		prev = cell;
+
+		if (is_utf8 && cell.wc >= 128) {
+			char buf[MB_CUR_MAX + 1];
+			mbstate_t ps = { 0 };
+			size_t len = wcrtomb(buf, cell.wc, &ps);
+			if (len > 0) {
+				waddnstr(win, buf, len);
+				if (wcwidth(cell.wc) > 1)
+					j++;
 			}
+		} else {
+			waddch(win, cell.wc > ' ' ? cell.wc : ' ');
 		}
+	}
 
-		int x, y;
-		getyx(win, y, x);
-		(void)y;
-		if (x && x < b->cols - 1)
-			whline(win, ' ', b->cols - x);
+	if (pairs && npairs < cols)
+		pairs[npairs] = 0;
 
-		row->dirty = false;
+	int cx, cy;
+	getyx(win, cy, cx);
+	(void)cy;
+	if (cx && cx < cols - 1)
+		whline(win, ' ', cols - cx);
+}
+
+void vt_draw(Vt *t, WINDOW *win, int srow, int scol)
+{
+	Buffer *b = t->buffer;
+
+	vt_render(t, srow, scol);
+	if (vt_sync_timeout(t) >= 0)
+		return;
+
+	for (int i = 0; i < b->rows; i++) {
+		Row *row = b->lines + i;
+		if (!row_tracked(t, i)) {
+			if (!row->dirty)
+				continue;
+			row->dirty = false;
+			draw_row(t, win, srow + i, scol, row->cells, b->cols, NULL);
+		} else if (t->shadow) {
+			if (!t->stale[i])
+				continue;
+			t->stale[i] = false;
+			draw_row(t, win, srow + i, scol, t->shadow + i * b->cols, b->cols,
+				 t->pairs + i * b->cols);
+		} else if (row->dirty) {
+			row->dirty = false;
+			if (!row_unchanged(t, row, i, b->cols))
+				draw_row(t, win, srow + i, scol, row->cells, b->cols,
+					 t->pairs + i * b->cols);
+		}
 	}
 
 	wmove(win, srow + b->curs_row - b->lines, scol + b->curs_col);
@@ -1653,6 +2000,11 @@ pid_t vt_forkpty(Vt *t, const char *p, const char *argv[], const char *cwd,
 		*from = ed2vt[0];
 	}
 
+	/* neither reads nor writes may block, see pty_write() */
+	int flags = fcntl(t->pty, F_GETFL);
+	if (flags >= 0)
+		fcntl(t->pty, F_SETFL, flags | O_NONBLOCK);
+
 	return t->pid = pid;
 }
 
@@ -1661,26 +2013,122 @@ int vt_pty_get(Vt *t)
 	return t->pty;
 }
 
+/* writes as much as the pty accepts, it is non-blocking */
+static ssize_t pty_write(Vt *t, const char *buf, size_t len)
+{
+	ssize_t written;
+	while ((written = write(t->pty, buf, len)) < 0 && errno == EINTR);
+	if (written < 0 && errno == EAGAIN)
+		return 0;
+	return written;
+}
+
+VtChunk *vt_chunk_new(const char *buf, size_t len)
+{
+	VtChunk *c = malloc(sizeof(*c) + len);
+	if (!c)
+		return NULL;
+	c->refs = 1;
+	c->bracketed = NULL;
+	c->len = len;
+	if (buf)
+		memcpy(c->data, buf, len);
+	return c;
+}
+
+void vt_chunk_put(VtChunk *c)
+{
+	if (c && !__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL)) {
+		vt_chunk_put(c->bracketed);
+		free(c);
+	}
+}
+
+static bool pending_add(Vt *t, VtChunk *chunk, size_t off)
+{
+	Pending *p = malloc(sizeof(*p));
+	if (!p)
+		return false;
+	__atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+	*p = (Pending){ .chunk = chunk, .off = off };
+	if (!t->pending)
+		t->pending_tail = &t->pending;
+	*t->pending_tail = p;
+	t->pending_tail = &p->next;
+	return true;
+}
+
+static void pending_clear(Vt *t)
+{
+	while (t->pending) {
+		Pending *p = t->pending;
+		t->pending = p->next;
+		vt_chunk_put(p->chunk);
+		free(p);
+	}
+}
+
+/* queues chunk for the pty after writing what can be written right away,
+ * the chunk is not copied and might thus be shared between terminals */
+ssize_t vt_write_chunk(Vt *t, VtChunk *chunk)
+{
+	ssize_t written = 0;
+	if (!t->pending && (written = pty_write(t, chunk->data, chunk->len)) < 0)
+		return -1;
+	if ((size_t)written < chunk->len && !pending_add(t, chunk, written))
+		return -1;
+	return chunk->len;
+}
+
 ssize_t vt_write(Vt *t, const char *buf, size_t len)
 {
 	if (len > SSIZE_MAX)
 		return -1;
 
-	ssize_t ret, rest;
-	ret = rest = (ssize_t)len;
+	ssize_t written = 0;
+	if (!t->pending && (written = pty_write(t, buf, len)) < 0)
+		return -1;
+	if ((size_t)written < len) {
+		VtChunk *chunk = vt_chunk_new(buf + written, len - written);
+		bool queued = chunk && pending_add(t, chunk, 0);
+		vt_chunk_put(chunk);
+		if (!queued)
+			return -1;
+	}
+	return len;
+}
+
+bool vt_write_pending(Vt *t)
+{
+	return t->pending;
+}
 
-	while (rest > 0) {
-		ssize_t written = write(t->pty, buf, rest);
+/* writes queued output until the pty would block, returns how much */
+ssize_t vt_write_flush(Vt *t)
+{
+	size_t total = 0;
+
+	while (t->pending) {
+		Pending *p = t->pending;
+		ssize_t written = pty_write(t, p->chunk->data + p->off, p->chunk->len - p->off);
 		if (written < 0) {
-			if (errno != EAGAIN && errno != EINTR)
-				return -1;
-			continue;
+			/* nobody is going to read it */
+			int err = errno;
+			pending_clear(t);
+			errno = err;
+			return -1;
 		}
-		buf += written;
-		rest -= written;
+		if (!written)
+			break;
+		total += written;
+		if ((p->off += written) < p->chunk->len)
+			continue;
+		t->pending = p->next;
+		vt_chunk_put(p->chunk);
+		free(p);
 	}
 
-	return ret;
+	return total;
 }
 
 static void send_curs(Vt *t)
@@ -1692,34 +2140,154 @@ static void send_curs(Vt *t)
 	vt_write(t, keyseq, strlen(keyseq));
 }
 
-void vt_keypress(Vt *t, int keycode)
+/* report the state of a private mode (DECRPM) */
+static void send_mode(Vt *t, int mode)
 {
-	vt_noscroll(t);
+	int state; /* 0: not recognized, 1: set, 2: reset */
+	char keyseq[32];
+
+	switch (mode) {
+	case 1:
+		state = t->curskeymode;
+		break;
+	case 6:
+		state = t->relposmode;
+		break;
+	case 25:
+		state = !t->curshid;
+		break;
+	case 47:
+	case 1047:
+	case 1049:
+		state = t->buffer == &t->buffer_alternate;
+		break;
+	case 1000:
+		state = t->mousetrack;
+		break;
+	case 2004:
+		state = t->bracketed_paste;
+		break;
+	case 2026:
+		state = t->sync;
+		break;
+	default:
+		state = -1;
+		break;
+	}
 
+	snprintf(keyseq, sizeof(keyseq), "\e[?%d;%d$y", mode, state < 0 ? 0 : 2 - state);
+	vt_write(t, keyseq, strlen(keyseq));
+}
+
+/* returns the sequence to send for keycode, buf holds those which vary */
+static const char *key_sequence(Vt *t, int keycode, char buf[3], size_t *len)
+{
 	if (keycode >= 0 && keycode <= KEY_MAX && keytable[keycode]) {
 		switch (keycode) {
 		case KEY_UP:
 		case KEY_DOWN:
 		case KEY_RIGHT:
-		case KEY_LEFT: {
-			char keyseq[3] = { '\e',
-					   (t->curskeymode ? 'O' : '['),
-					   keytable[keycode][0] };
-			vt_write(t, keyseq, sizeof(keyseq));
-			break;
-		}
+		case KEY_LEFT:
+			buf[0] = '\e';
+			buf[1] = t->curskeymode ? 'O' : '[';
+			buf[2] = keytable[keycode][0];
+			*len = 3;
+			return buf;
 		default:
-			vt_write(t, keytable[keycode],
-				 strlen(keytable[keycode]));
+			*len = strlen(keytable[keycode]);
+			return keytable[keycode];
 		}
 	} else if (keycode <= UCHAR_MAX) {
-		char c = keycode;
-		vt_write(t, &c, 1);
+		buf[0] = keycode;
+		*len = 1;
+		return buf;
 	} else {
 #ifndef NDEBUG
 		fprintf(stderr, "unhandled key %#o\n", keycode);
 #endif
+		*len = 0;
+		return buf;
+	}
+}
+
+/* writes the sequences of several keys at once */
+void vt_keypresses(Vt *t, const int keys[], size_t count)
+{
+	char buf[BUFSIZ], seqbuf[3];
+	size_t len = 0;
+
+	vt_noscroll(t);
+
+	for (size_t i = 0; i < count; i++) {
+		size_t seqlen;
+		const char *seq = key_sequence(t, keys[i], seqbuf, &seqlen);
+		if (len + seqlen > sizeof(buf)) {
+			vt_write(t, buf, len);
+			len = 0;
+		}
+		if (seqlen > sizeof(buf)) {
+			vt_write(t, seq, seqlen);
+			continue;
+		}
+		memcpy(buf + len, seq, seqlen);
+		len += seqlen;
+	}
+	if (len)
+		vt_write(t, buf, len);
+}
+
+void vt_keypress(Vt *t, int keycode)
+{
+	vt_keypresses(t, &keycode, 1);
+}
+
+/* text enclosed in paste markers, an end marker within the text could not be
+ * told apart and is thus left out */
+static VtChunk *chunk_bracket(const char *buf, size_t len)
+{
+	VtChunk *c = vt_chunk_new(NULL, len + 12);
+	if (!c)
+		return NULL;
+	size_t n = 6;
+	memcpy(c->data, "\e[200~", 6);
+	for (const char *end = buf + len; buf < end;) {
+		if (end - buf >= 6 && !memcmp(buf, "\e[201~", 6))
+			buf += 6;
+		else
+			c->data[n++] = *buf++;
+	}
+	memcpy(c->data + n, "\e[201~", 6);
+	c->len = n + 6;
+	return c;
+}
+
+/* pastes text, enclosed in markers if the application asked for them */
+void vt_paste(Vt *t, const char *buf, size_t len)
+{
+	vt_noscroll(t);
+	if (!t->bracketed_paste) {
+		vt_write(t, buf, len);
+		return;
+	}
+	VtChunk *c = chunk_bracket(buf, len);
+	if (c)
+		vt_write_chunk(t, c);
+	vt_chunk_put(c);
+}
+
+/* the same for a chunk which is pasted to several terminals, its enclosed
+ * form is kept with it and thus also only created once */
+void vt_paste_chunk(Vt *t, VtChunk *text)
+{
+	vt_noscroll(t);
+	if (!t->bracketed_paste) {
+		vt_write_chunk(t, text);
+		return;
 	}
+	if (!text->bracketed)
+		text->bracketed = chunk_bracket(text->data, text->len);
+	if (text->bracketed)
+		vt_write_chunk(t, text->bracketed);
 }
 
 void vt_mouse(Vt *t, int x, int y, mmask_t mask)
@@ -1761,53 +2329,265 @@ void vt_mouse(Vt *t, int x, int y, mmask_t mask)
 #endif /* NCURSES_MOUSE_VERSION */
 }
 
-static unsigned int color_hash(short int fg, short int bg)
+static const int color_ansi[16] = {
+	0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+	0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff,
+};
+
+static const int color_levels[6] = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
+
+/* RGB value of a palette entry, assuming the xterm defaults */
+static int color_palette_rgb(int color)
+{
+	if (color < 16)
+		return color_ansi[color];
+	if (color < 232) {
+		color -= 16;
+		return color_levels[color / 36] << 16 |
+		       color_levels[color / 6 % 6] << 8 |
+		       color_levels[color % 6];
+	}
+	return (8 + (color - 232) * 10) * 0x010101;
+}
+
+static int color_distance(int rgb1, int rgb2)
 {
-	if (fg == -1)
-		fg = COLORS;
-	if (bg == -1)
-		bg = COLORS + 1;
-	return fg * (COLORS + 2) + bg;
+	int r = (rgb1 >> 16 & 0xff) - (rgb2 >> 16 & 0xff);
+	int g = (rgb1 >> 8 & 0xff) - (rgb2 >> 8 & 0xff);
+	int b = (rgb1 & 0xff) - (rgb2 & 0xff);
+	return r * r + g * g + b * b;
 }
 
-short int vt_color_get(Vt *t, short int fg, short int bg)
+/* index of the color cube level closest to an 8 bit color component */
+static int color_level(int v)
 {
+	return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+}
+
+/* Find the palette entry closest to an RGB color. Applications using true
+ * color tend to use a handful of distinct colors over and over again, the
+ * results are therefore remembered in a small direct mapped cache.
+ */
+static short int color_quantize(int rgb)
+{
+	ColorQuantized *q = &color_quantized[((uint32_t)rgb * 2654435761u) >> 22];
+	if (q->rgb == rgb)
+		return q->color;
+
+	int best = 0, dist = INT_MAX, r = rgb >> 16 & 0xff, g = rgb >> 8 & 0xff, b = rgb & 0xff;
+	if (COLORS >= 256) {
+		int gray = ((r + g + b) / 3 - 3) / 10;
+		int candidates[] = {
+			16 + 36 * color_level(r) + 6 * color_level(g) + color_level(b),
+			232 + MAX(0, MIN(gray, 23)),
+		};
+		for (unsigned int i = 0; i < countof(candidates); i++) {
+			int d = color_distance(rgb, color_palette_rgb(candidates[i]));
+			if (d < dist) {
+				dist = d;
+				best = candidates[i];
+			}
+		}
+	} else {
+		for (int i = 0; i < MIN(COLORS, 16); i++) {
+			int d = color_distance(rgb, color_ansi[i]);
+			if (d < dist) {
+				dist = d;
+				best = i;
+			}
+		}
+	}
+
+	q->rgb = rgb;
+	q->color = best;
+	return best;
+}
+
+/* Map a cell color to one the terminal understands: RGB colors are
+ * quantized unless the terminal supports direct colors, in which case
+ * palette entries beyond the 8 basic ones have to be given as RGB.
+ */
+static int color_resolve(int color)
+{
+	if (color == -1)
+		return -1;
+	if (!has_direct_colors)
+		return IS_COLOR_RGB(color) ? color_quantize(color) : color;
+	if (!IS_COLOR_RGB(color) && color < 8)
+		return color;
+	int rgb = IS_COLOR_RGB(color) ? color & 0xffffff : color_palette_rgb(MIN(color, 255));
+	return MAX(rgb, 8); /* values below 8 denote the basic palette entries */
+}
+
+static int color_pair_init(short int pair, int fg, int bg)
+{
+#if HAVE_EXTENDED_COLORS
+	return init_extended_pair(pair, fg, bg);
+#else
+	return init_pair(pair, fg, bg);
+#endif
+}
+
+static unsigned int color_hash(int fg, int bg)
+{
+	return (((uint32_t)fg * 2654435761u) ^ (uint32_t)bg) * 2246822519u;
+}
+
+/* returns either the mapping of (fg, bg) or the empty slot where it belongs */
+static ColorMapping *color_mapping(int fg, int bg)
+{
+	unsigned int i = color_hash(fg, bg) & color2palette_mask;
+	while (color2palette[i].pair && (color2palette[i].fg != fg || color2palette[i].bg != bg))
+		i = (i + 1) & color2palette_mask;
+	return &color2palette[i];
+}
+
+/* remove a mapping, subsequent entries of the probe sequence are shifted
+ * back such that no tombstones are needed */
+static void color_mapping_remove(ColorMapping *m)
+{
+	unsigned int i = m - color2palette, j = i, k;
+
+	color2palette_count--;
+	for (;;) {
+		color2palette[i].pair = 0;
+		do {
+			j = (j + 1) & color2palette_mask;
+			if (!color2palette[j].pair)
+				return;
+			k = color_hash(color2palette[j].fg, color2palette[j].bg) & color2palette_mask;
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		color2palette[i] = color2palette[j];
+		i = j;
+	}
+}
+
+static bool color_mapping_grow(void)
+{
+	unsigned int size = color2palette_mask + 1;
+	ColorMapping *old = color2palette, *new = calloc(2 * size, sizeof(ColorMapping));
+	if (!new)
+		return false;
+	color2palette = new;
+	color2palette_mask = 2 * size - 1;
+	for (unsigned int i = 0; i < size; i++) {
+		if (old[i].pair)
+			*color_mapping(old[i].fg, old[i].bg) = old[i];
+	}
+	free(old);
+	return true;
+}
+
+/* insert a mapping which must not yet exist, the table is kept at most half full */
+static bool color_mapping_add(int fg, int bg, short int pair)
+{
+	if (2 * (color2palette_count + 1) > color2palette_mask + 1 && !color_mapping_grow() &&
+	    color2palette_count + 1 > color2palette_mask)
+		return false;
+	*color_mapping(fg, bg) = (ColorMapping){ .fg = fg, .bg = bg, .pair = pair };
+	color2palette_count++;
+	return true;
+}
+
+/* Find a color pair to (re)use. Pairs are initialized on first use, once
+ * all of them are taken they are visited in clock order and the first one
+ * which is not shown in any window and was not used during the current or
+ * the previous frame is taken. Otherwise the least recently used one is
+ * evicted, pairs still shown are only reused if there is no other choice.
+ */
+static short int color_pair_victim(void)
+{
+	short int victim = 0;
+	unsigned int oldest = UINT_MAX;
+	bool shown = true;
+
+	if (color_pairs_top + 1 < color_pairs_max)
+		return color_pairs_top + 1;
+
+	for (int i = color_pairs_reserved + 1; i < color_pairs_max; i++) {
+		if (++color_pair_current >= color_pairs_max ||
+		    color_pair_current <= color_pairs_reserved)
+			color_pair_current = color_pairs_reserved + 1;
+		ColorPair *cp = &color_pairs[color_pair_current];
+		if (!cp->refs && cp->frame + 1 < color_frame)
+			return color_pair_current;
+		if ((shown && !cp->refs) || (shown == !!cp->refs && cp->frame < oldest)) {
+			oldest = cp->frame;
+			shown = cp->refs;
+			victim = color_pair_current;
+		}
+	}
+
+	return victim;
+}
+
+/* drop the mapping of a pair which is about to be reinitialized */
+static void color_pair_unmap(short int pair)
+{
+	ColorPair *cp = &color_pairs[pair];
+	if (!cp->frame)
+		return;
+	ColorMapping *m = color_mapping(cp->fg, cp->bg);
+	if (m->pair == pair || m->pair == -pair)
+		color_mapping_remove(m);
+}
+
+short int vt_color_get(Vt *t, int fg, int bg)
+{
+	fg = color_resolve(fg);
+	bg = color_resolve(bg);
+
 	if (fg >= COLORS)
-		fg = (t ? t->deffg : default_fg);
+		fg = color_resolve(t ? t->deffg : default_fg);
 	if (bg >= COLORS)
-		bg = (t ? t->defbg : default_bg);
+		bg = color_resolve(t ? t->defbg : default_bg);
 
 	if (!has_default_colors) {
 		if (fg == -1)
-			fg = (t && t->deffg != -1 ? t->deffg : default_fg);
+			fg = color_resolve(t && t->deffg != -1 ? t->deffg : default_fg);
 		if (bg == -1)
-			bg = (t && t->defbg != -1 ? t->defbg : default_bg);
+			bg = color_resolve(t && t->defbg != -1 ? t->defbg : default_bg);
 	}
 
 	if (!color2palette || (fg == -1 && bg == -1))
 		return 0;
-	unsigned int index = color_hash(fg, bg);
-	if (color2palette[index] == 0) {
-		short int oldfg, oldbg;
-		while (1) {
-			if (++color_pair_current >= color_pairs_max)
-				color_pair_current = color_pairs_reserved + 1;
-			pair_content(color_pair_current, &oldfg, &oldbg);
-			unsigned int old_index = color_hash(oldfg, oldbg);
-			if (color2palette[old_index] >= 0) {
-				if (init_pair(color_pair_current, fg, bg) == OK) {
-					color2palette[old_index] = 0;
-					color2palette[index] = color_pair_current;
-				}
-				break;
+	short int color_pair = color_mapping(fg, bg)->pair;
+	if (color_pair == 0) {
+		short int pair = color_pair_victim();
+		color_misses++;
+		if (pair > 0 && color_pair_init(pair, fg, bg) == OK) {
+			ColorPair *cp = &color_pairs[pair];
+			if (cp->frame) {
+				color_pair_unmap(pair);
+				color_evictions++;
 			}
+			/* rows still showing it, if any, are counted further */
+			*cp = (ColorPair){ .fg = fg, .bg = bg, .frame = color_frame, .refs = cp->refs };
+			color_pairs_top = MAX(color_pairs_top, pair);
+			if (color_mapping_add(fg, bg, pair))
+				color_pair = pair;
 		}
+	} else {
+		color_hits++;
 	}
 
-	short int color_pair = color2palette[index];
+	if (color_pair > 0)
+		color_pairs[color_pair].frame = color_frame;
 	return color_pair >= 0 ? color_pair : -color_pair;
 }
 
+void vt_color_frame(void)
+{
+	color_frame++;
+}
+
+void vt_color_stats(unsigned long *hits, unsigned long *misses, unsigned long *evictions)
+{
+	*hits = color_hits;
+	*misses = color_misses;
+	*evictions = color_evictions;
+}
+
 short int vt_color_reserve(short int fg, short int bg)
 {
 	if (!color2palette || fg >= COLORS || bg >= COLORS)
@@ -1818,12 +2598,23 @@ short int vt_color_reserve(short int fg, short int bg)
 		bg = default_bg;
 	if (fg == -1 && bg == -1)
 		return 0;
-	unsigned int index = color_hash(fg, bg);
-	if (color2palette[index] >= 0) {
-		if (init_pair(color_pairs_reserved + 1, fg, bg) == OK)
-			color2palette[index] = -(++color_pairs_reserved);
+	int rfg = color_resolve(fg), rbg = color_resolve(bg);
+	ColorMapping *m = color_mapping(rfg, rbg);
+	short int color_pair = m->pair;
+	if (color_pair >= 0 && color_pairs_reserved + 1 < color_pairs_max) {
+		short int pair = color_pairs_reserved + 1;
+		if (color_pair_init(pair, rfg, rbg) == OK) {
+			color_pair_unmap(pair);
+			if ((m = color_mapping(rfg, rbg))->pair)
+				color_mapping_remove(m);
+			color_pairs[pair] = (ColorPair){ .fg = rfg, .bg = rbg, .frame = color_frame,
+							 .refs = color_pairs[pair].refs };
+			color_pairs_reserved++;
+			color_pairs_top = MAX(color_pairs_top, pair);
+			color_mapping_add(rfg, rbg, -pair);
+			color_pair = -pair;
+		}
 	}
-	short int color_pair = color2palette[index];
 	return color_pair >= 0 ? color_pair : -color_pair;
 }
 
@@ -1835,17 +2626,21 @@ static void init_colors(void)
 	if (default_bg == -1)
 		default_bg = COLOR_BLACK;
 	has_default_colors = (use_default_colors() == OK);
+#if HAVE_EXTENDED_COLORS
+	has_direct_colors = COLORS >= 0x1000000;
+#endif
 	color_pairs_max = MIN(MAX_COLOR_PAIRS, SHRT_MAX);
-	if (COLORS)
-		color2palette =	calloc((COLORS + 2) * (COLORS + 2), sizeof(short int));
-	/*
-	 * XXX: On undefined color-pairs NetBSD curses pair_content() set fg
-	 *      and bg to default colors while ncurses set them respectively to
-	 *      0 and 0. Initialize all color-pairs in order to have consistent
-	 *      behaviour despite the implementation used.
-	 */
-	for (short int i = 1; i < color_pairs_max; i++)
-		init_pair(i, 0, 0);
+	/* pairs are only initialized once they are needed, the mapping from
+	 * colors to pairs grows on demand */
+	if (COLORS) {
+		color2palette = calloc(64, sizeof(ColorMapping));
+		color2palette_mask = 64 - 1;
+		color_pairs = calloc(color_pairs_max, sizeof(ColorPair));
+		if (!color_pairs) {
+			free(color2palette);
+			color2palette = NULL;
+		}
+	}
 	vt_color_reserve(COLOR_WHITE, COLOR_BLACK);
 }
 
@@ -1860,6 +2655,17 @@ void vt_init(void)
 		 COLORS >= 256 ? "-256color" : "");
 }
 
+void vt_strict_compare_set(bool strict)
+{
+	strict_compare = strict;
+}
+
+/* vt_render() is called from other threads, before vt_draw() */
+void vt_render_concurrent_set(bool concurrent)
+{
+	render_concurrent = concurrent;
+}
+
 void vt_keytable_set(const char *const keytable_overlay[], int count)
 {
 	for (int k = 0; k < count && k < KEY_MAX; k++) {
@@ -1872,6 +2678,8 @@ void vt_keytable_set(const char *const keytable_overlay[], int count)
 void vt_shutdown(void)
 {
 	free(color2palette);
+	free(color_pairs);
+	color_pairs = NULL;
 }
 
 void vt_title_handler_set(Vt *t, vt_title_handler_t handler)
@@ -1894,6 +2702,11 @@ void *vt_data_get(Vt *t)
 	return t->data;
 }
 
+bool vt_curskeymode_get(Vt *t)
+{
+	return t->curskeymode;
+}
+
 bool vt_cursor_visible(Vt *t)
 {
 	return t->buffer->scroll_below ? false : !t->curshid;
@@ -1944,6 +2757,11 @@ size_t vt_content_get(Vt *t, char **buf, bool colored)
 				 || cell->attr != prev_cell->attr) {
 					if (cell->fg == -1)
 						esclen = sprintf(s, "\033[39m");
+					else if (IS_COLOR_RGB(cell->fg))
+						esclen = sprintf(s, "\033[38;2;%d;%d;%dm",
+								 cell->fg >> 16 & 0xff,
+								 cell->fg >> 8 & 0xff,
+								 cell->fg & 0xff);
 					else
 						esclen = sprintf(s, "\033[38;5;%dm",
 								 cell->fg);
@@ -1955,6 +2773,11 @@ size_t vt_content_get(Vt *t, char **buf, bool colored)
 				 || cell->attr != prev_cell->attr) {
 					if (cell->bg == -1)
 						esclen = sprintf(s, "\033[49m");
+					else if (IS_COLOR_RGB(cell->bg))
+						esclen = sprintf(s, "\033[48;2;%d;%d;%dm",
+								 cell->bg >> 16 & 0xff,
+								 cell->bg >> 8 & 0xff,
+								 cell->bg & 0xff);
 					else
 						esclen = sprintf(s, "\033[48;5;%dm",
 								 cell->bg);
@@ -28,6 +28,7 @@
 #endif
 
 typedef struct Vt Vt;
+typedef struct VtChunk VtChunk;
 typedef void (*vt_title_handler_t)(Vt *, const char *title);
 typedef void (*vt_urgent_handler_t)(Vt *);
 
@@ -35,6 +36,8 @@ extern void vt_init(void);
 extern void vt_shutdown(void);
 
 extern void vt_keytable_set(char const *const keytable_overlay[], int count);
+extern void vt_strict_compare_set(bool strict);
+extern void vt_render_concurrent_set(bool concurrent);
 extern void vt_default_colors_set(Vt *, attr_t attrs, short int fg, short int bg);
 extern void vt_title_handler_set(Vt *, vt_title_handler_t);
 extern void vt_urgent_handler_set(Vt *, vt_urgent_handler_t);
@@ -48,15 +51,29 @@ extern pid_t vt_forkpty(Vt *, const char *p, const char *argv[], const char *cwd
 			const char *env[], int *to, int *from);
 extern int vt_pty_get(Vt *);
 extern bool vt_cursor_visible(Vt *);
+extern bool vt_curskeymode_get(Vt *);
 
-extern int vt_process(Vt *);
+extern ssize_t vt_process(Vt *, size_t max);
+extern void vt_process_data(Vt *, const char *buf, size_t len);
 extern void vt_keypress(Vt *, int keycode);
+extern void vt_keypresses(Vt *, const int keys[], size_t count);
+extern void vt_paste(Vt *, const char *buf, size_t len);
+extern void vt_paste_chunk(Vt *, VtChunk *);
 extern ssize_t vt_write(Vt *, const char *buf, size_t len);
+extern ssize_t vt_write_chunk(Vt *, VtChunk *);
+extern bool vt_write_pending(Vt *);
+extern ssize_t vt_write_flush(Vt *);
+extern VtChunk *vt_chunk_new(const char *buf, size_t len);
+extern void vt_chunk_put(VtChunk *);
 extern void vt_mouse(Vt *, int x, int y, mmask_t mask);
 extern void vt_dirty(Vt *);
+extern int vt_sync_timeout(Vt *);
+extern void vt_render(Vt *, int startrow, int startcol);
 extern void vt_draw(Vt *, WINDOW *win, int startrow, int startcol);
-extern short int vt_color_get(Vt *, short int fg, short int bg);
+extern short int vt_color_get(Vt *, int fg, int bg);
 extern short int vt_color_reserve(short int fg, short int bg);
+extern void vt_color_frame(void);
+extern void vt_color_stats(unsigned long *hits, unsigned long *misses, unsigned long *evictions);
 
 extern void vt_scroll(Vt *, int rows);
 extern void vt_noscroll(Vt *);